@@ -0,0 +1,196 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+// Heap allocations of creating temporaries: counts them through replaced global operators new and
+// delete, and fails (exit status 1) unless a creation allocates no more than storing its resulting
+// path_t does (its text and its parsed components), and trying another candidate name allocates
+// nothing. Each case creates one temporary with no collision and one after `collisions` names
+// taken on purpose (by counter naming, which makes the next names known), so the difference is the
+// cost of the retries alone.
+//
+//   cmake -S . -B build && cmake --build build && ctest --test-dir build
+//   build/tempfile_allocation_budget [base directory]
+
+#include <tempfile/tempfile.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+
+static std::atomic<std::uint64_t> allocations{0};
+
+void * operator new(std::size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto * memory = std::malloc(size == 0 ? 1 : size))
+  {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void * memory) noexcept
+{
+  std::free(memory);
+}
+
+void operator delete(void * memory, std::size_t) noexcept
+{
+  std::free(memory);
+}
+
+
+namespace
+{
+
+constexpr int collisions = 16;
+
+struct scenario
+{
+  char const * name;
+  tempfile::options options;
+  bool directory;
+};
+
+// Allocations of creating (not destroying) one temporary of `s`.
+std::uint64_t creation_allocations(scenario const & s, tempfile::path_t & created)
+{
+  std::uint64_t counted = 0;
+  if (s.directory)
+  {
+    tempfile::directory directory(tempfile::default_prefix, s.options);
+    auto const before = allocations.load();
+    directory.create();
+    counted = allocations.load() - before;
+    created = directory.path();
+  }
+  else
+  {
+    tempfile::file file(tempfile::default_prefix, s.options);
+    auto const before = allocations.load();
+    file.create();
+    counted = allocations.load() - before;
+    created = file.path();
+  }
+  return counted;
+}
+
+// Allocations of storing `path` as a path_t, the budget of a creation that resulted in it.
+std::uint64_t storing_allocations(tempfile::path_t const & path)
+{
+  auto const & text = path.native();
+  auto const before = allocations.load();
+  tempfile::path_t stored(text);
+  return allocations.load() - before;
+}
+
+// names taken on purpose, removed again at the end
+std::vector<tempfile::path_t> taken;
+
+// Creates files under the `collisions` names that follow `last`, whose name ends in a hexadecimal
+// counter.
+void take_following(tempfile::path_t const & last)
+{
+  auto const name = last.filename().string();
+  auto const digits = name.find_last_not_of("0123456789abcdef") + 1;
+  auto const next = std::stoull(name.substr(digits), nullptr, 16) + 1;
+  for (auto i = 0; i < collisions; ++i)
+  {
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "%llx", static_cast<unsigned long long>(next + i));
+    taken.push_back(last.parent_path() / (name.substr(0, digits) + suffix));
+    std::ofstream(taken.back());
+  }
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+  if (argc > 1)
+  {
+    tempfile::set_base_directories({argv[1]});
+  }
+  tempfile::session session("allocation_budget");
+
+  tempfile::options counter;
+  counter.naming = tempfile::naming::counter;
+  tempfile::options in_session;
+  in_session.session = &session;
+
+  std::vector<scenario> const scenarios = {
+    {"file, counter naming", counter, false},
+    {"directory, counter naming", counter, true},
+    {"file in a session", in_session, false},
+    {"directory in a session", in_session, true},
+  };
+
+  // the first round warms up the per-process caches (base directories, storage probes, registry)
+  constexpr int rounds = 3;
+  auto failed = false;
+  for (auto const & s : scenarios)
+  {
+    auto best_create = static_cast<std::uint64_t>(-1);
+    auto best_retries = static_cast<std::uint64_t>(-1);
+    std::uint64_t budget = 0;
+    auto arranged = true;
+    for (auto round = 0; round < rounds && arranged; ++round)
+    {
+      tempfile::path_t created;
+      auto const plain = creation_allocations(s, created);
+      budget = storing_allocations(created);
+      take_following(created);
+      auto const collided_before = tempfile::stats().collisions;
+      auto const with_retries = creation_allocations(s, created);
+      arranged = tempfile::stats().collisions - collided_before == collisions;
+      if (!arranged)
+      {
+        std::printf("%-28s could not arrange %d collisions\n", s.name, collisions);
+        failed = true;
+      }
+      if (round > 0)
+      {
+        best_create = std::min(best_create, plain);
+        best_retries = std::min(best_retries, with_retries > plain ? with_retries - plain : 0);
+      }
+    }
+    if (!arranged)
+    {
+      continue;
+    }
+    auto const over = best_create > budget || best_retries > 0;
+    std::printf("%-28s %2llu allocations per creation (budget %llu), %llu in %d retries (budget 0) %s\n", s.name,
+                static_cast<unsigned long long>(best_create), static_cast<unsigned long long>(budget),
+                static_cast<unsigned long long>(best_retries), collisions, over ? "OVER" : "ok");
+    failed = failed || over;
+  }
+  for (auto const & path : taken)
+  {
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+  }
+  return failed ? 1 : 0;
+}
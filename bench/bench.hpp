@@ -0,0 +1,136 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+#ifndef TEMPFILE_BENCH_BENCH_HPP
+#define TEMPFILE_BENCH_BENCH_HPP
+
+// Helpers shared by the tempfile benchmarks.
+
+#include <tempfile/tempfile.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+namespace bench
+{
+
+// Base directories to run against: the colon separated TEMPFILE_BENCH_BASES, or the library
+// defaults plus /dev/shm when it exists. An empty path stands for the library defaults.
+inline std::vector<std::string> bases()
+{
+  std::vector<std::string> result;
+  if (auto const * env = std::getenv("TEMPFILE_BENCH_BASES"))
+  {
+    std::string list = env;
+    for (std::size_t start = 0, end; start <= list.size(); start = end + 1)
+    {
+      end = std::min(list.find(':', start), list.size());
+      if (end > start)
+      {
+        result.push_back(list.substr(start, end - start));
+      }
+    }
+    return result;
+  }
+  result.emplace_back();
+  if (std::filesystem::is_directory("/dev/shm"))
+  {
+    result.emplace_back("/dev/shm");
+  }
+  return result;
+}
+
+inline std::string base_name(std::string const & base)
+{
+  return base.empty() ? "default" : base;
+}
+
+// Points the library at `base` for the whole process; call from thread 0 before the timed loop.
+inline void use_base(std::string const & base)
+{
+  if (base.empty())
+  {
+    tempfile::set_base_directories({});
+  }
+  else
+  {
+    tempfile::set_base_directories({base});
+  }
+}
+
+// Per-thread latency samples, reported as p50/p99 counters averaged over the threads.
+class latencies
+{
+public:
+  explicit latencies(std::size_t expected = 1u << 16u) { _samples.reserve(expected); }
+
+  template <typename Op>
+  void time(Op && op)
+  {
+    auto const start = std::chrono::steady_clock::now();
+    op();
+    _samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  [[nodiscard]] std::size_t count() const { return _samples.size(); }
+
+  struct summary
+  {
+    double p50 = 0;
+    double p99 = 0;
+    double max = 0;
+  };
+
+  summary summarize()
+  {
+    if (_samples.empty())
+    {
+      return {};
+    }
+    std::sort(_samples.begin(), _samples.end());
+    auto const at = [this](double q) { return _samples[static_cast<std::size_t>(q * static_cast<double>(_samples.size() - 1))]; };
+    return {at(0.50), at(0.99), _samples.back()};
+  }
+
+  void report(benchmark::State & state, std::string const & name)
+  {
+    if (_samples.empty())
+    {
+      return;
+    }
+    auto const result = summarize();
+    state.counters[name + "_p50_us"] = benchmark::Counter(result.p50, benchmark::Counter::kAvgThreads);
+    state.counters[name + "_p99_us"] = benchmark::Counter(result.p99, benchmark::Counter::kAvgThreads);
+    state.counters[name + "_max_us"] = benchmark::Counter(result.max, benchmark::Counter::kAvgThreads);
+  }
+
+private:
+  std::vector<double> _samples;
+};
+
+}
+
+#endif //TEMPFILE_BENCH_BENCH_HPP
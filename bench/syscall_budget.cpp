@@ -0,0 +1,122 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+// Hard budget on the file system calls of the hot paths: runs each operation under the counting
+// shim and fails (exit status 1) if any of them issues more calls than its budget, so stray
+// existence probes and other extra calls cannot creep back in unnoticed.
+//
+//   cmake -S . -B build && cmake --build build && ctest --test-dir build
+//   build/tempfile_syscall_budget [base directory]
+
+#include "syscall_counter.hpp"
+
+#include <tempfile/tempfile.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+namespace
+{
+
+constexpr int populated_files = 8;
+
+struct operation
+{
+  char const * name;
+  std::uint64_t budget;
+  std::function<void()> setup;  // not counted
+  std::function<void()> run;    // counted
+};
+
+void print_counts()
+{
+  for (std::size_t kind = 0; kind < tempfile_syscalls_kinds(); ++kind)
+  {
+    if (tempfile_syscalls_count(kind) > 0)
+    {
+      std::printf(" %s=%llu", tempfile_syscalls_name(kind),
+                  static_cast<unsigned long long>(tempfile_syscalls_count(kind)));
+    }
+  }
+  std::printf("\n");
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+  if (argc > 1)
+  {
+    tempfile::set_base_directories({argv[1]});
+  }
+
+  std::unique_ptr<tempfile::directory> directory;
+  std::vector<operation> const operations = {
+    // open, fstat (bytes removed), close, unlink
+    {"scoped_file create+destroy", 4, [] {}, [] { tempfile::scoped_file file; }},
+    // mkdir, openat, fdopendir, closedir, unlinkat
+    {"scoped_directory create+destroy", 5, [] {}, [] { tempfile::scoped_directory directory; }},
+    // openat, fdopendir, closedir, unlinkat, plus fstatat (bytes removed) and unlinkat per file
+    {"directory::remove() with 8 files", 4 + 2 * populated_files,
+     [&directory]
+     {
+       directory = std::make_unique<tempfile::directory>();
+       directory->create();
+       for (auto i = 0; i < populated_files; ++i)
+       {
+         std::ofstream(directory->path() / std::to_string(i)) << i;
+       }
+     },
+     [&directory] { directory->remove(); }},
+  };
+
+  // the first round warms up the per-process caches (base directories, storage probes)
+  constexpr int rounds = 5;
+  auto failed = false;
+  for (auto const & op : operations)
+  {
+    // periodic refreshes (e.g. of the cgroup memory reading) are amortized, so take the best round
+    auto best = static_cast<std::uint64_t>(-1);
+    for (auto round = 0; round < rounds; ++round)
+    {
+      op.setup();
+      tempfile_syscalls_reset();
+      op.run();
+      auto const calls = tempfile_syscalls_total();
+      if (round > 0 && calls < best)
+      {
+        best = calls;
+      }
+    }
+    // the breakdown printed is that of the last round
+    auto const over = best > op.budget;
+    std::printf("%-36s %3llu calls (budget %llu) %s:", op.name, static_cast<unsigned long long>(best),
+                static_cast<unsigned long long>(op.budget), over ? "OVER" : "ok");
+    print_counts();
+    failed = failed || over;
+  }
+  directory.reset();
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+// Counting shim for the file system calls the library can make, see syscall_counter.hpp.
+
+#include "syscall_counter.hpp"
+
+#include <cstdarg>
+#include <cstdio>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+
+#define TEMPFILE_SYSCALLS(X) \
+  X(open) X(open64) X(openat) X(openat64) X(close) X(mkdir) X(mkdirat) X(mkostemp) X(mkdtemp) X(memfd_create) \
+  X(unlink) X(unlinkat) X(rmdir) X(rename) X(renameat) X(stat) X(stat64) X(lstat) X(lstat64) X(fstat) X(fstat64) \
+  X(fstatat) X(fstatat64) X(statx) X(statfs) X(statfs64) X(statvfs) X(statvfs64) X(access) X(faccessat) \
+  X(opendir) X(fdopendir) X(closedir) X(remove) X(read) X(write) X(lseek) X(fcntl) X(flock) X(ftruncate) X(fsync)
+
+namespace
+{
+
+enum kind : std::size_t
+{
+#define TEMPFILE_KIND(name) kind_##name,
+  TEMPFILE_SYSCALLS(TEMPFILE_KIND)
+#undef TEMPFILE_KIND
+  kinds
+};
+
+char const * const names[] = {
+#define TEMPFILE_NAME(name) #name,
+  TEMPFILE_SYSCALLS(TEMPFILE_NAME)
+#undef TEMPFILE_NAME
+};
+
+thread_local std::uint64_t counts[kinds];
+
+template <typename Function>
+Function next(char const * name)
+{
+  return reinterpret_cast<Function>(::dlsym(RTLD_NEXT, name));
+}
+
+}
+
+#define TEMPFILE_COUNTED(ret, name, params, args) \
+  extern "C" ret name params \
+  { \
+    static auto const real = next<ret (*) params>(#name); \
+    ++counts[kind_##name]; \
+    return real args; \
+  }
+
+// open and openat only take a mode with O_CREAT or O_TMPFILE
+#define TEMPFILE_COUNTED_OPEN(name, params, args, last) \
+  extern "C" int name params \
+  { \
+    static auto const real = next<int (*) params>(#name); \
+    ++counts[kind_##name]; \
+    mode_t mode = 0; \
+    if ((flags & O_CREAT) != 0 || (flags & O_TMPFILE) == O_TMPFILE) \
+    { \
+      va_list arguments; \
+      va_start(arguments, last); \
+      mode = va_arg(arguments, mode_t); \
+      va_end(arguments); \
+    } \
+    return real args; \
+  }
+
+TEMPFILE_COUNTED_OPEN(open, (char const * path, int flags, ...), (path, flags, mode), flags)
+TEMPFILE_COUNTED_OPEN(open64, (char const * path, int flags, ...), (path, flags, mode), flags)
+TEMPFILE_COUNTED_OPEN(openat, (int dirfd, char const * path, int flags, ...), (dirfd, path, flags, mode), flags)
+TEMPFILE_COUNTED_OPEN(openat64, (int dirfd, char const * path, int flags, ...), (dirfd, path, flags, mode), flags)
+
+extern "C" int fcntl(int fd, int command, ...)
+{
+  static auto const real = next<int (*)(int, int, ...)>("fcntl");
+  ++counts[kind_fcntl];
+  va_list arguments;
+  va_start(arguments, command);
+  auto * const argument = va_arg(arguments, void *);
+  va_end(arguments);
+  return real(fd, command, argument);
+}
+
+TEMPFILE_COUNTED(int, close, (int fd), (fd))
+TEMPFILE_COUNTED(int, mkdir, (char const * path, mode_t mode), (path, mode))
+TEMPFILE_COUNTED(int, mkdirat, (int dirfd, char const * path, mode_t mode), (dirfd, path, mode))
+TEMPFILE_COUNTED(int, mkostemp, (char * pattern, int flags), (pattern, flags))
+TEMPFILE_COUNTED(char *, mkdtemp, (char * pattern), (pattern))
+TEMPFILE_COUNTED(int, memfd_create, (char const * name, unsigned flags), (name, flags))
+TEMPFILE_COUNTED(int, unlink, (char const * path), (path))
+TEMPFILE_COUNTED(int, unlinkat, (int dirfd, char const * path, int flags), (dirfd, path, flags))
+TEMPFILE_COUNTED(int, rmdir, (char const * path), (path))
+TEMPFILE_COUNTED(int, rename, (char const * from, char const * to), (from, to))
+TEMPFILE_COUNTED(int, renameat, (int from_dir, char const * from, int to_dir, char const * to), (from_dir, from, to_dir, to))
+TEMPFILE_COUNTED(int, stat, (char const * path, struct stat * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, stat64, (char const * path, struct stat64 * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, lstat, (char const * path, struct stat * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, lstat64, (char const * path, struct stat64 * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, fstat, (int fd, struct stat * buffer), (fd, buffer))
+TEMPFILE_COUNTED(int, fstat64, (int fd, struct stat64 * buffer), (fd, buffer))
+TEMPFILE_COUNTED(int, fstatat, (int dirfd, char const * path, struct stat * buffer, int flags), (dirfd, path, buffer, flags))
+TEMPFILE_COUNTED(int, fstatat64, (int dirfd, char const * path, struct stat64 * buffer, int flags), (dirfd, path, buffer, flags))
+TEMPFILE_COUNTED(int, statx, (int dirfd, char const * path, int flags, unsigned mask, struct statx * buffer), (dirfd, path, flags, mask, buffer))
+TEMPFILE_COUNTED(int, statfs, (char const * path, struct statfs * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, statfs64, (char const * path, struct statfs64 * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, statvfs, (char const * path, struct statvfs * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, statvfs64, (char const * path, struct statvfs64 * buffer), (path, buffer))
+TEMPFILE_COUNTED(int, access, (char const * path, int mode), (path, mode))
+TEMPFILE_COUNTED(int, faccessat, (int dirfd, char const * path, int mode, int flags), (dirfd, path, mode, flags))
+TEMPFILE_COUNTED(DIR *, opendir, (char const * path), (path))
+TEMPFILE_COUNTED(DIR *, fdopendir, (int fd), (fd))
+TEMPFILE_COUNTED(int, closedir, (DIR * dir), (dir))
+TEMPFILE_COUNTED(int, remove, (char const * path), (path))
+TEMPFILE_COUNTED(ssize_t, read, (int fd, void * buffer, size_t size), (fd, buffer, size))
+TEMPFILE_COUNTED(ssize_t, write, (int fd, void const * buffer, size_t size), (fd, buffer, size))
+TEMPFILE_COUNTED(off_t, lseek, (int fd, off_t offset, int whence), (fd, offset, whence))
+TEMPFILE_COUNTED(int, flock, (int fd, int operation), (fd, operation))
+TEMPFILE_COUNTED(int, ftruncate, (int fd, off_t size), (fd, size))
+TEMPFILE_COUNTED(int, fsync, (int fd), (fd))
+
+
+extern "C" std::uint64_t tempfile_syscalls_total()
+{
+  std::uint64_t total = 0;
+  for (auto const count : counts)
+  {
+    total += count;
+  }
+  return total;
+}
+
+extern "C" std::size_t tempfile_syscalls_kinds()
+{
+  return kinds;
+}
+
+extern "C" char const * tempfile_syscalls_name(std::size_t kind)
+{
+  return kind < kinds ? names[kind] : "";
+}
+
+extern "C" std::uint64_t tempfile_syscalls_count(std::size_t kind)
+{
+  return kind < kinds ? counts[kind] : 0;
+}
+
+extern "C" void tempfile_syscalls_reset()
+{
+  for (auto & count : counts)
+  {
+    count = 0;
+  }
+}
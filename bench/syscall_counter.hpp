@@ -0,0 +1,44 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+#ifndef TEMPFILE_BENCH_SYSCALL_COUNTER_HPP
+#define TEMPFILE_BENCH_SYSCALL_COUNTER_HPP
+
+// Interface of the syscall counting shim (syscall_counter.cpp). Linking it into an executable, or
+// LD_PRELOADing it, interposes the C library's file system calls and counts them per thread.
+// The counts are of libc entry points: a directory read counts once per opendir, not per getdents.
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C"
+{
+// Calls made by the current thread since the last reset.
+std::uint64_t tempfile_syscalls_total();
+
+// Calls made by the current thread since the last reset, per interposed function.
+std::size_t tempfile_syscalls_kinds();
+char const * tempfile_syscalls_name(std::size_t kind);
+std::uint64_t tempfile_syscalls_count(std::size_t kind);
+
+void tempfile_syscalls_reset();
+}
+
+#endif //TEMPFILE_BENCH_SYSCALL_COUNTER_HPP
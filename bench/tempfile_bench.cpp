@@ -0,0 +1,210 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+// Creation and destruction throughput and latency of scoped temporaries.
+//
+//   cmake -S . -B build -DTEMPFILE_BUILD_BENCH=ON && cmake --build build
+//   TEMPFILE_BENCH_BASES=/dev/shm:/mnt/nvme0/tmp build/tempfile_bench
+
+#include "bench.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <thread>
+
+
+namespace
+{
+
+int max_threads()
+{
+  return static_cast<int>(std::max(2u, std::thread::hardware_concurrency()));
+}
+
+// Files named as tempfile::naming state.range(0).
+void scoped_file(benchmark::State & state, std::string const & base)
+{
+  if (state.thread_index() == 0)
+  {
+    bench::use_base(base);
+  }
+  tempfile::options opts;
+  opts.naming = static_cast<tempfile::naming>(state.range(0));
+  bench::latencies create, destroy;
+  for (auto _ : state)
+  {
+    std::unique_ptr<tempfile::scoped_file> file;
+    create.time([&] { file = std::make_unique<tempfile::scoped_file>(tempfile::default_prefix, opts); });
+    if (!file->good())
+    {
+      state.SkipWithError("creating the file failed");
+      break;
+    }
+    destroy.time([&] { file.reset(); });
+  }
+  state.SetItemsProcessed(state.iterations());
+  create.report(state, "create");
+  destroy.report(state, "destroy");
+}
+
+// The same with compact handles (tempfile::handle) in place of scoped files.
+void handle(benchmark::State & state, std::string const & base)
+{
+  if (state.thread_index() == 0)
+  {
+    bench::use_base(base);
+  }
+  bench::latencies create, destroy;
+  for (auto _ : state)
+  {
+    std::optional<tempfile::handle> file;
+    create.time([&] { file.emplace(); });
+    if (!file->good())
+    {
+      state.SkipWithError("creating the file failed");
+      break;
+    }
+    destroy.time([&] { file.reset(); });
+  }
+  state.SetItemsProcessed(state.iterations());
+  create.report(state, "create");
+  destroy.report(state, "destroy");
+}
+
+// Directory holding state.range(0) files, so destruction covers removing populated trees.
+void scoped_directory(benchmark::State & state, std::string const & base)
+{
+  if (state.thread_index() == 0)
+  {
+    bench::use_base(base);
+  }
+  auto const files = state.range(0);
+  bench::latencies create, destroy;
+  for (auto _ : state)
+  {
+    std::unique_ptr<tempfile::scoped_directory> directory;
+    create.time([&] { directory = std::make_unique<tempfile::scoped_directory>(); });
+    if (!directory->good())
+    {
+      state.SkipWithError("creating the directory failed");
+      break;
+    }
+
+    state.PauseTiming();
+    for (auto i = 0; i < files; ++i)
+    {
+      std::ofstream(directory->path() / std::to_string(i)) << i;
+    }
+    state.ResumeTiming();
+
+    destroy.time([&] { directory.reset(); });
+  }
+  state.SetItemsProcessed(state.iterations());
+  create.report(state, "create");
+  destroy.report(state, "destroy");
+}
+
+// Mixed load: range(1) of the threads keep tearing down directories of range(0) files while the
+// others create and destroy scoped files for as long as each teardown round takes. Reports the
+// creation latency seen by the creators, the number to watch for any concurrency work on the
+// library (e.g. the global mutex held during removal); range(1) = 0 gives the uncontended baseline.
+std::atomic<std::int64_t> teardowns{0};
+
+void mixed_load(benchmark::State & state, std::string const & base)
+{
+  if (state.thread_index() == 0)
+  {
+    bench::use_base(base);
+    teardowns = 0;
+  }
+  auto const files = state.range(0);
+  auto const removers = static_cast<int>(state.range(1));
+  auto const creators = state.threads() - removers;
+  auto const remover = state.thread_index() < removers;
+
+  bench::latencies create;
+  std::int64_t round = 0;
+  for (auto _ : state)
+  {
+    if (remover)
+    {
+      {
+        tempfile::scoped_directory directory;
+        for (auto i = 0; i < files; ++i)
+        {
+          std::ofstream(directory.path() / std::to_string(i)) << i;
+        }
+      }
+      teardowns.fetch_add(1);
+      continue;
+    }
+
+    // keep creating until every remover is done with this round
+    ++round;
+    do
+    {
+      std::unique_ptr<tempfile::scoped_file> file;
+      create.time([&] { file = std::make_unique<tempfile::scoped_file>(); });
+      file.reset();
+    }
+    while (teardowns.load() < round * removers);
+  }
+
+  if (!remover)
+  {
+    // each creator contributes its share, so the summed counters are the creators' average
+    auto const summary = create.summarize();
+    state.counters["create_p50_us"] = summary.p50 / creators;
+    state.counters["create_p99_us"] = summary.p99 / creators;
+    state.counters["create_max_us"] = summary.max / creators;
+    state.counters["creates"] = static_cast<double>(create.count());
+  }
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+  for (auto const & base : bench::bases())
+  {
+    auto const name = bench::base_name(base);
+    benchmark::RegisterBenchmark(("scoped_file/" + name).c_str(), scoped_file, base)
+      ->ArgName("naming")->DenseRange(0, 2)->ThreadRange(1, max_threads())->UseRealTime();
+    benchmark::RegisterBenchmark(("handle/" + name).c_str(), handle, base)
+      ->ThreadRange(1, max_threads())->UseRealTime();
+    benchmark::RegisterBenchmark(("scoped_directory/" + name).c_str(), scoped_directory, base)
+      ->Arg(0)->Arg(16)->Arg(1024)->ThreadRange(1, max_threads())->UseRealTime();
+    benchmark::RegisterBenchmark(("mixed_load/" + name).c_str(), mixed_load, base)
+      ->ArgNames({"files", "removers"})->Args({1000, 0})->Args({1000, 1})->Args({10000, 1})->Args({10000, 2})
+      ->Threads(4)->Threads(std::max(4, max_threads()))->UseRealTime();
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+  {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
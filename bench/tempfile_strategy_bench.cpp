@@ -0,0 +1,151 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+// Compares the creation strategies of the library on every kind of local filesystem found:
+// ops/s and file system calls per create+remove cycle.
+//
+//   cmake -S . -B build -DTEMPFILE_BUILD_BENCH=ON && cmake --build build
+//   build/tempfile_strategy_bench
+
+#include "bench.hpp"
+#include "syscall_counter.hpp"
+
+#include <map>
+
+#include <sys/statfs.h>
+#include <unistd.h>
+
+
+namespace
+{
+
+std::string filesystem_name(tempfile::path_t const & path)
+{
+  struct statfs fs{};
+  if (::statfs(path.c_str(), &fs) != 0)
+  {
+    return {};
+  }
+  switch (static_cast<unsigned long>(fs.f_type))
+  {
+  case 0x01021994:
+    return "tmpfs";
+  case 0xef53:
+    return "ext4";
+  case 0x58465342:
+    return "xfs";
+  case 0x794c7630:
+    return "overlayfs";
+  case 0x9123683e:
+    return "btrfs";
+  case 0x2fc12fc1:
+    return "zfs";
+  default:
+    return "fs-" + std::to_string(static_cast<unsigned long>(fs.f_type));
+  }
+}
+
+// One writable directory per filesystem type, from TEMPFILE_BENCH_BASES or the usual places.
+std::map<std::string, std::string> filesystems()
+{
+  std::vector<std::string> candidates;
+  for (auto const & base : bench::bases())
+  {
+    if (!base.empty())
+    {
+      candidates.push_back(base);
+    }
+  }
+  if (std::getenv("TEMPFILE_BENCH_BASES") == nullptr)
+  {
+    for (auto const * path : {"/tmp", "/var/tmp", "/dev/shm"})
+    {
+      candidates.emplace_back(path);
+    }
+    candidates.push_back(std::filesystem::current_path().string());
+  }
+
+  std::map<std::string, std::string> found;
+  for (auto const & path : candidates)
+  {
+    if (::access(path.c_str(), W_OK) == 0)
+    {
+      found.emplace(filesystem_name(path), path);
+    }
+  }
+  return found;
+}
+
+template <typename Temporary>
+void create_remove(benchmark::State & state, std::string const & base, tempfile::strategy strategy)
+{
+  bench::use_base(base);
+  tempfile::options opts;
+  opts.strategy = strategy;
+
+  tempfile_syscalls_reset();
+  for (auto _ : state)
+  {
+    Temporary temporary(tempfile::default_prefix, opts);
+    if (!temporary.good())
+    {
+      state.SkipWithError("not supported here");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["syscalls_per_op"] = benchmark::Counter(static_cast<double>(tempfile_syscalls_total()),
+                                                         benchmark::Counter::kAvgIterations);
+}
+
+}
+
+
+int main(int argc, char ** argv)
+{
+  using tempfile::strategy;
+  for (auto const & [name, base] : filesystems())
+  {
+    for (auto const & [strategy_name, file_strategy] : {std::pair{"exclusive", strategy::exclusive},
+                                                        std::pair{"mkstemp", strategy::mkstemp},
+                                                        std::pair{"unnamed", strategy::unnamed}})
+    {
+      benchmark::RegisterBenchmark(("file/" + name + "/" + strategy_name).c_str(),
+                                   create_remove<tempfile::scoped_file>, base, file_strategy);
+    }
+    for (auto const & [strategy_name, directory_strategy] : {std::pair{"exclusive", strategy::exclusive},
+                                                             std::pair{"mkdtemp", strategy::mkstemp}})
+    {
+      benchmark::RegisterBenchmark(("directory/" + name + "/" + strategy_name).c_str(),
+                                   create_remove<tempfile::scoped_directory>, base, directory_strategy);
+    }
+  }
+  // memfd is not on any filesystem
+  benchmark::RegisterBenchmark("file/memfd", create_remove<tempfile::scoped_file>, std::string(), strategy::memory);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+  {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -24,8 +24,13 @@
 // This module handles the creation of temporary files and directories and their cleanup.
 // It is based on the RAII idiom and is inspired in Python's tempfile module implementation.
 
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <system_error>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 
 // test if its MSVC compiler
@@ -38,7 +43,7 @@
 #elif __cplusplus >= 201703L
 #define TEMPFILE_HAS_FILESYSTEM
 #else
-#under TEMPFILE_HAS_FILESYSTEM
+#undef TEMPFILE_HAS_FILESYSTEM
 #endif
 
 #ifdef TEMPFILE_HAS_FILESYSTEM
@@ -57,50 +62,411 @@ typedef std::string path_t;
 #endif
 
 
+// Storage backing a base directory, as probed from its filesystem.
+enum class storage_kind
+{
+  unknown,
+  memory,   // tmpfs, ramfs
+  ssd,      // local non-rotational block device (e.g. NVMe)
+  disk,     // local rotational block device
+  network,  // NFS, SMB, Ceph, ...
+};
+
+// How candidate base directories are ranked before creating a temporary in them. All policies
+// other than `first` skip network filesystems.
+enum class storage_policy
+{
+  first,      // try base directories in their configured order, whatever backs them
+  memory,     // prefer memory, then ssd, then disk
+  local,      // prefer ssd, then disk, then memory
+  automatic,  // `memory` for temporaries up to small_size bytes, `local` for larger ones
+};
+
+// Size up to which the automatic storage policy prefers memory-backed directories.
+constexpr std::uintmax_t small_size = 16u << 20u;
+
+// Probes (once per process and path) which kind of storage backs `path`.
+[[nodiscard]] storage_kind storage_of(path_t const & path);
+
+
+// How new temporaries are spread over the base directories set with set_base_directories().
+enum class placement
+{
+  round_robin,   // rotate the first directory tried on every creation
+  least_loaded,  // try the directory holding the fewest live temporaries first
+};
+
+// Replaces the default base directories (TMPDIR, /tmp, ...; read from the environment once, on
+// first use) with `paths` for the whole process, spreading new temporaries over them, e.g. to use
+// the bandwidth of several local drives. At most 32 of them are tried per creation. An empty list
+// restores the defaults.
+void set_base_directories(std::vector<path_t> const & paths, placement mode = placement::round_robin);
+
+// A storage tier for set_tiers(): base directories backed by `kind`, holding at most `budget`
+// bytes of temporaries (0 for no limit).
+struct tier
+{
+  storage_kind kind;
+  std::uintmax_t budget = 0;
+};
+
+// Routes new temporaries to the first tier, in the given order, whose budget is not used up,
+// e.g. {memory, 1 GiB}, {ssd, 100 GiB}, {disk}. The base directories of each tier are the ones
+// set with set_base_directories() of that kind, or if none are set the default candidates (plus
+// /dev/shm on Linux) of that kind. Files are charged for the bytes written through file::write()
+// and are moved down to the next tier once their tier runs out of budget; directories are charged
+// their size hint. A tier set again with the same kind and budget keeps what is charged to it. An
+// empty list disables tiering.
+void set_tiers(std::vector<tier> const & tiers);
+
+// Memory-backed base directories are skipped once the memory left to the process's cgroup,
+// minus the size hint, drops below `bytes` (64 MiB by default), as tmpfs pages count against
+// that limit. 0 disables the check.
+void set_memory_headroom(std::uintmax_t bytes);
+
+// Removes the directories named `prefix`... in the base directories whose owner marker (see
+// options::mark_owner) names a process that no longer runs, i.e. trees left behind by crashed or
+// killed processes. Directories without a marker are left alone. Cheap enough to call at every
+// process start; returns the number of trees removed.
+std::size_t sweep_orphans(std::string const & prefix = default_prefix);
+
+// Removes every temporary file and directory still alive in this process in one pass, a directory
+// descriptor per parent; returns the number removed. The objects stay valid and find their
+// temporaries already gone. Unnamed and memory files have nothing to remove.
+std::size_t cleanup_all();
+
+// Runs cleanup_all() at normal process exit (std::exit, returning from main).
+void set_cleanup_at_exit(bool enable);
+
+// Removes the live temporaries when a fatal signal arrives (SIGSEGV, SIGABRT, SIGTERM, SIGINT, ...),
+// then lets the signal end the process. Only signals left at their default action are taken over;
+// those the application ignores or handles are left alone. Best effort: the handler only walks
+// lists kept ready beforehand and makes async-signal-safe calls, so it leaves the counters untouched.
+void set_cleanup_on_signals(bool enable);
+
+// Snapshot of the process-wide counters kept by the library.
+struct statistics
+{
+  std::uint64_t creates = 0;
+  std::uint64_t removes = 0;
+  std::uint64_t collisions = 0;     // candidate names that already existed
+  std::uint64_t bytes_removed = 0;  // size of the files removed, including those in directories
+  std::uint64_t live_files = 0;
+  std::uint64_t live_directories = 0;
+
+  // Extra names tried, per base directory used so far.
+  std::vector<std::pair<path_t, std::uint64_t>> retries;
+
+  // Failed creations and removals, per errno value.
+  std::vector<std::pair<int, std::uint64_t>> failures;
+};
+
+[[nodiscard]] statistics stats();
+
+// Operations whose latency the library records.
+enum class operation
+{
+  directory_create,
+  directory_remove,
+  file_create,
+  cleanup,  // removal done by ~file() and ~directory()
+};
+
+// Percentiles of a latency histogram, accurate to within a quarter of the value.
+struct latency_summary
+{
+  std::uint64_t count = 0;
+  std::uint64_t p50_ns = 0;
+  std::uint64_t p99_ns = 0;
+  std::uint64_t max_ns = 0;
+};
+
+[[nodiscard]] latency_summary latency(operation op);
+
+// Usage of temporaries created with a given options::label.
+struct label_usage
+{
+  std::string label;
+  std::uint64_t live = 0;
+  std::uint64_t creates = 0;
+  double creates_per_second = 0;  // since the label was first used
+  std::uint64_t bytes = 0;          // written through file::write() to live files
+  std::uint64_t bytes_removed = 0;  // size of the files removed, including those in directories
+  std::uint64_t cleanups = 0;
+  std::uint64_t cleanup_ns = 0;     // total time spent removing
+};
+
+[[nodiscard]] std::vector<label_usage> usage_by_label();
+
+// stats() and the latency of every operation as a JSON object.
+[[nodiscard]] std::string stats_json();
+
+namespace detail
+{
+struct registration;
+struct base;
+struct tier;
+struct label;
+}
+
+
+// How temporaries are created.
+enum class strategy
+{
+  exclusive,  // random names created with O_EXCL / mkdir, retried on collision
+  mkstemp,    // mkstemp(3) for files and mkdtemp(3) for directories, the C library picks the name
+  unnamed,    // files only (Linux): O_TMPFILE in the base directory, never visible by name
+  memory,     // files only (Linux): memfd_create, not on any filesystem
+};
+
+// How temporaries are spread over subdirectories of their base directory (or session), so that
+// neither the contention on one directory nor its size grow with the number of live temporaries.
+// The subdirectories are created on first use and left in place for later temporaries.
+enum class fan_out
+{
+  none,        // directly in the base directory
+  hashed,      // in one of 256 subdirectories, picked by the name
+  per_thread,  // in a subdirectory of the creating thread (one of 256)
+};
+
+// How the names of temporaries are made.
+enum class naming
+{
+  random,          // random characters, retried on collisions
+  counter,         // process id, thread and a per-thread counter: unique by construction
+  salted_counter,  // counter, plus a short random salt against names left by an earlier process
+};
+
+struct session;
+
+// Creation hints shared by directories and files.
+struct options
+{
+  // Path the temporary will eventually be renamed to. When set, the temporary is created on the
+  // same filesystem as the destination (in a hidden ".tempfile" sibling directory, or next to the
+  // destination itself), so publishing it is a metadata-only rename instead of a copy. The sibling
+  // is created private to the user and only used if it is a directory the user owns; this is
+  // checked once per parent directory.
+  path_t near;
+
+  // Ranking of base directories by the storage backing them.
+  storage_policy policy = storage_policy::first;
+
+  // Expected size of the temporary in bytes, 0 if unknown. When set, base directories without
+  // that much free space (after `reserve`) are skipped and the one with the most room is preferred.
+  std::uintmax_t size_hint = 0;
+
+  // Bytes to leave free on a filesystem when checking it against the size hint.
+  std::uintmax_t reserve = 0;
+
+  // Files created with the unnamed and memory strategies have no name of their own; their path()
+  // is /proc/self/fd/<descriptor>, valid in this process only.
+  tempfile::strategy strategy = tempfile::strategy::exclusive;
+
+  // Directories only: write an owner marker (pid and process start time) into the directory, so
+  // sweep_orphans() can remove it once its process is gone, e.g. after it was killed.
+  bool mark_owner = false;
+
+  // Files only: let child processes inherit the descriptor across exec. Descriptors are close-on-
+  // exec by default; see also file::set_inheritable().
+  bool inheritable = false;
+
+  // Name of the subsystem owning the temporary (e.g. "sort-spill"), to attribute usage to it,
+  // see usage_by_label(). Unlabeled temporaries are not attributed.
+  std::string label;
+
+  // Naming of the temporary; exclusive strategy only. In a session the process id is left out,
+  // so counter names are the same from run to run.
+  tempfile::naming naming = tempfile::naming::random;
+
+  // Subdirectory layout to create the temporary in; directory and mkstemp strategies only.
+  tempfile::fan_out fan_out = tempfile::fan_out::none;
+
+  // Session to create the temporary in, instead of a base directory; the one set with
+  // set_default_session() if null. Ignored when `near` is set.
+  tempfile::session * session = nullptr;
+
+  // Create the temporary in a base directory even while a default session is set, e.g. for one
+  // that has to outlive the session. Session roots are always created this way.
+  bool bypass_default_session = false;
+};
+
+
+// Temporaries are owned by one object at a time: moving one transfers the temporary and leaves the
+// source empty, assigning to one removes the temporary it held first. Destructors never throw.
 struct directory
 {
-  explicit directory(std::string prefix = default_prefix);
-  ~directory();
-  [[nodiscard]] path_t path() const { return _path; };
+  explicit directory(std::string prefix = default_prefix, options opts = {});
+  directory(directory const &) = delete;
+  directory & operator=(directory const &) = delete;
+  directory(directory && other) noexcept;
+  directory & operator=(directory && other) noexcept;
+  ~directory() noexcept;
+  [[nodiscard]] path_t const & path() const { return _path; };
 
   bool create();
-  bool remove();
+  bool remove() noexcept;
+
+  // As above, reporting why they failed in `ec` instead of only counting it (see stats()).
+  bool create(std::error_code & ec);
+  bool remove(std::error_code & ec) noexcept;
 
   [[nodiscard]] bool good() const { return _good; };
 
 private:
   bool _good;
-  std::string const _prefix;
+  std::string _prefix;
+  options _options;
   path_t _path;
+  detail::base * _base = nullptr;
+  detail::tier * _tier = nullptr;
+  detail::label * _label = nullptr;
+  detail::registration * _registration = nullptr;
+  bool _deferred = false;
+  int _owner_pid = 0;
 };
 
 
 struct scoped_directory : public directory
 {
-  explicit scoped_directory(std::string prefix = default_prefix);
-  ~scoped_directory();
+  explicit scoped_directory(std::string prefix = default_prefix, options opts = {});
+  scoped_directory(scoped_directory &&) noexcept = default;
+  scoped_directory & operator=(scoped_directory &&) noexcept = default;
+  ~scoped_directory() noexcept;
+};
+
+
+// A private root directory (placed according to `opts`, and carrying an owner marker) for the
+// temporaries of this process. Temporaries created in a session get short counter names and are
+// created relative to a descriptor of the root (mkdirat/openat), so they do not contend on the
+// shared base directory and need neither random names nor retries. Destroying the session removes
+// the whole tree in one pass; temporaries still alive then find themselves already removed.
+//
+// With `keep_until_exit`, temporaries of the session are not removed one by one: destroying or
+// removing them only closes and forgets them, and they stay on disk until the session goes (or,
+// after a crash, until sweep_orphans()). Meant for short-lived batch processes, where it turns
+// thousands of unlinks into one bulk removal off the critical path.
+struct session
+{
+  explicit session(std::string prefix = default_prefix, options opts = {}, bool keep_until_exit = false);
+  session(session const &) = delete;
+  session & operator=(session const &) = delete;
+  ~session();
+
+  [[nodiscard]] path_t const & path() const { return _root.path(); };
+
+  // O_PATH descriptor of the root, -1 where not supported.
+  [[nodiscard]] int native_handle() const { return _fd; };
+
+  [[nodiscard]] bool good() const { return _root.good(); };
+
+  [[nodiscard]] bool keeps_until_exit() const { return _keep_until_exit; };
+
+  // Unique name for a new entry of the root: `prefix` followed by a counter, or made as `how`.
+  [[nodiscard]] std::string next_name(std::string const & prefix, naming how = naming::random);
+
+  // Index for a new entry of the root, counting up from 0.
+  [[nodiscard]] std::uint64_t next_index() { return _counter.fetch_add(1, std::memory_order_relaxed); };
+
+private:
+  directory _root;
+  int _fd = -1;
+  bool const _keep_until_exit;
+  std::atomic<std::uint64_t> _counter{0};
 };
 
+// Makes temporaries created without options::session go to `s` (nullptr to stop doing so).
+void set_default_session(session * s);
+
 
 struct file
 {
-  explicit file(std::string prefix = default_prefix);
-  ~file();
-  [[nodiscard]] path_t path() const { return _path; };
+  explicit file(std::string prefix = default_prefix, options opts = {});
+  file(file const &) = delete;
+  file & operator=(file const &) = delete;
+  file(file && other) noexcept;
+  file & operator=(file && other) noexcept;
+  ~file() noexcept;
+  [[nodiscard]] path_t const & path() const { return _path; };
+
+  // Descriptor of the open file, -1 if it was not created.
+  [[nodiscard]] int native_handle() const { return _fd; };
+
+  bool create();
+  bool remove() noexcept;
+
+  // Appends `size` bytes to the file, accounting them to its storage tier (see set_tiers()).
+  bool write(void const * data, std::size_t size);
 
-  bool remove();
+  // As above, reporting why they failed in `ec` instead of only counting it (see stats()).
+  bool create(std::error_code & ec);
+  bool remove(std::error_code & ec) noexcept;
+  bool write(void const * data, std::size_t size, std::error_code & ec);
+
+  // Whether child processes inherit the descriptor across exec.
+  bool set_inheritable(bool inheritable);
 
   [[nodiscard]] bool good() const { return _good; };
+  [[nodiscard]] std::uintmax_t size() const { return _size; };
 private:
+  bool demote(std::uintmax_t size);
+
   bool _good;
   std::string _prefix;
+  options _options;
   path_t _path;
+  int _fd = -1;
+  std::uintmax_t _size = 0;
+  detail::base * _base = nullptr;
+  detail::tier * _tier = nullptr;
+  detail::label * _label = nullptr;
+  detail::registration * _registration = nullptr;
+  bool _deferred = false;
+  int _owner_pid = 0;
 };
 
 struct scoped_file : public file
 {
-  explicit scoped_file(std::string prefix = default_prefix);
-  ~scoped_file();
+  explicit scoped_file(std::string prefix = default_prefix, options opts = {});
+  scoped_file(scoped_file &&) noexcept = default;
+  scoped_file & operator=(scoped_file &&) noexcept = default;
+  ~scoped_file() noexcept;
+};
+
+
+// A temporary file kept as small as it gets, for holding millions of them (e.g. spill chunks): the
+// index of its interned base directory, its name (up to 50 characters with the prefix), its
+// descriptor and owner, one cache line and no heap memory. The prefix can take what the longest
+// name of the naming leaves: 42 characters with random names, 16 with counter names and 11 with
+// salted ones; longer prefixes fail with ENAMETOOLONG. The path is put together on demand. Created
+// on construction like scoped_file and removed on destruction; movable like file. Placement, naming
+// and sessions follow `opts`; fan-out, tiers and labels do not apply, and the mkstemp strategy is
+// not supported. Handles are not registered for cleanup_all().
+struct handle
+{
+  explicit handle(std::string const & prefix = default_prefix, options const & opts = {});
+  handle(handle const &) = delete;
+  handle & operator=(handle const &) = delete;
+  handle(handle && other) noexcept;
+  handle & operator=(handle && other) noexcept;
+  ~handle() noexcept;
+
+  // Path of the file, put together from the base directory and the name; empty if not created.
+  [[nodiscard]] path_t path() const;
+
+  // Descriptor of the open file, -1 if it was not created.
+  [[nodiscard]] int native_handle() const { return _fd; };
+
+  [[nodiscard]] bool good() const { return _fd >= 0; };
+
+  bool remove() noexcept;
+
+private:
+  std::uint32_t _base = 0;
+  int _fd = -1;
+  int _owner_pid = 0;
+  char _name[51] = {};
+  bool _deferred = false;
 };
 
 }
@@ -20,8 +20,23 @@
 
 #include <tempfile/tempfile.hpp>
 
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
 #include <mutex>
+#include <random>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -31,8 +46,21 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <fileapi.h>
+#include <io.h>
 #else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #endif
 
 
@@ -42,7 +70,13 @@
 #endif
 
 
+namespace
+{
+
 static std::mutex mutex;
+static std::mutex probe_mutex;
+static std::mutex cgroup_mutex;
+static std::mutex cleanup_mutex;
 
 
 #ifdef _WIN32
@@ -63,63 +97,449 @@ static constexpr const size_t max_path_length = MAX_PATH;
 static constexpr const int max_path_length = 4096;
 #endif
 
+// Fixed-size text built on the stack, so trying candidate names allocates nothing.
+template <std::size_t Size>
+struct text_buffer
+{
+  // Appends `size` characters, returning false (and leaving the text as it was) if they do not fit.
+  bool append(char const * data, std::size_t size)
+  {
+    if (length + size + 1 > Size)
+    {
+      return false;
+    }
+    std::memcpy(text + length, data, size);
+    length += size;
+    text[length] = '\0';
+    return true;
+  }
+
+  bool append(std::string_view data) { return append(data.data(), data.size()); }
+
+  void truncate(std::size_t to)
+  {
+    length = to;
+    text[length] = '\0';
+  }
+
+  [[nodiscard]] char const * c_str() const { return text; }
+  [[nodiscard]] std::string_view view() const { return {text, length}; }
+
+  char text[Size] = {};
+  std::size_t length = 0;
+};
+
+using path_buffer = text_buffer<static_cast<std::size_t>(max_path_length)>;
+using name_buffer = text_buffer<max_file_name_length + 1>;
+
+// Appends `path` and a separator.
+bool append_directory(path_buffer & buffer, tempfile::path_t const & path)
+{
+#ifdef _WIN32
+  return buffer.append(path.string()) && buffer.append(path_separator);
+#else
+  return buffer.append(path.native()) && buffer.append(path_separator);
+#endif
+}
+
+
+// Process-wide counters behind tempfile::stats(), relaxed so they can stay on in production.
+static struct
+{
+  std::atomic<std::uint64_t> creates{0};
+  std::atomic<std::uint64_t> removes{0};
+  std::atomic<std::uint64_t> collisions{0};
+  std::atomic<std::uint64_t> bytes_removed{0};
+  std::atomic<std::int64_t> live_files{0};
+  std::atomic<std::int64_t> live_directories{0};
+  std::array<std::atomic<std::uint64_t>, 256> failures{};
+} counters;
+
+void count(std::atomic<std::uint64_t> & counter, std::uint64_t value = 1)
+{
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// Error of the last failure counted on this thread, for the error_code overloads.
+thread_local int last_failure = 0;
+
+void count_failure(int error)
+{
+  if (error > 0)
+  {
+    count(counters.failures[static_cast<std::size_t>(error) % counters.failures.size()]);
+    last_failure = error;
+  }
+}
+
+// Runs `operation` (returning whether it succeeded) and reports the error it counted, or
+// `otherwise` if it failed without one, in `ec`.
+template <typename Operation>
+bool reporting(std::error_code & ec, int otherwise, Operation operation)
+{
+  last_failure = 0;
+  auto const done = operation();
+  auto const error = done ? 0 : last_failure != 0 ? last_failure : otherwise;
+  ec = error != 0 ? std::error_code(error, std::generic_category()) : std::error_code{};
+  return done;
+}
+
+
+// Creates the directory `path`, returning 0 or the error (EEXIST if it already exists).
+[[nodiscard]] int make_directory(char const * path)
+{
+#ifdef _WIN32
+  std::error_code ec;
+  if (std::filesystem::create_directory(tempfile::path_t(path), ec))
+  {
+    return 0;
+  }
+  return ec ? ec.value() : EEXIST;
+#else
+  // private to the user, like mkdtemp(3)
+  return ::mkdir(path, 0700) == 0 ? 0 : errno;
+#endif
+}
+
+[[nodiscard]] int make_directory(tempfile::path_t const & path)
+{
+#ifdef _WIN32
+  return make_directory(path.string().c_str());
+#else
+  return make_directory(path.c_str());
+#endif
+}
+
+// Creates `path` exclusively and returns its open descriptor, -1 if it already exists or failed.
+[[nodiscard]] int open_file(char const * path)
+{
+#ifdef _WIN32
+  int fd = -1;
+  _sopen_s(&fd, path, _O_RDWR | _O_CREAT | _O_EXCL | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+  return fd;
+#else
+  return ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+#endif
+}
+
+void close_file(int & fd)
+{
+  if (fd >= 0)
+  {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+bool write_all(int fd, char const * data, std::size_t size)
+{
+  while (size > 0)
+  {
+    auto const written = ::write(fd, data, static_cast<unsigned>(std::min<std::size_t>(size, 1u << 30u)));
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+// Copies the first `size` bytes of `from` to the end of `to`.
+bool copy_contents(int from, int to, std::uintmax_t size)
+{
+  char buffer[64 * 1024];
+  if (::lseek(from, 0, SEEK_SET) != 0)
+  {
+    return false;
+  }
+  while (size > 0)
+  {
+    auto const got = ::read(from, buffer, static_cast<unsigned>(std::min<std::uintmax_t>(size, sizeof(buffer))));
+    if (got < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (got <= 0 || !write_all(to, buffer, static_cast<std::size_t>(got)))
+    {
+      return false;
+    }
+    size -= static_cast<std::uintmax_t>(got);
+  }
+  return true;
+}
 
-bool make_directory(tempfile::path_t const & path)
+// Removes the file `path`, returning 0 or the error (ENOENT if it does not exist).
+[[nodiscard]] int remove_file(char const * path)
 {
-  return std::filesystem::create_directory(path);
+#ifdef _WIN32
+  std::error_code ec;
+  if (std::filesystem::remove(tempfile::path_t(path), ec))
+  {
+    return 0;
+  }
+  return ec ? ec.value() : ENOENT;
+#else
+  return ::unlink(path) == 0 ? 0 : errno;
+#endif
 }
 
-[[nodiscard]] bool directory_exists(tempfile::path_t const & path)
+[[nodiscard]] int remove_file(tempfile::path_t const & path)
 {
-  return std::filesystem::is_directory(path);
+#ifdef _WIN32
+  return remove_file(path.string().c_str());
+#else
+  return remove_file(path.c_str());
+#endif
 }
 
-[[nodiscard]] bool file_exists(tempfile::path_t const & path)
+#ifndef _WIN32
+// Removes the directory `name` under `parent` with all its contents, adding the size of the removed
+// files to `bytes`. Works on descriptors, so each entry is resolved once instead of by full path.
+[[nodiscard]] int remove_tree_at(int parent, char const * name, std::uint64_t & bytes)
 {
-  return std::filesystem::exists(path);
+  auto const fd = ::openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return errno;
+  }
+  auto * dir = ::fdopendir(fd);
+  if (dir == nullptr)
+  {
+    auto const error = errno;
+    ::close(fd);
+    return error;
+  }
+
+  auto error = 0;
+  while (auto const * entry = ::readdir(dir))
+  {
+    if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+    {
+      continue;
+    }
+    auto is_directory = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_REG || entry->d_type == DT_UNKNOWN)
+    {
+      struct stat st{};
+      if (::fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+      {
+        is_directory = S_ISDIR(st.st_mode);
+        bytes += S_ISREG(st.st_mode) ? static_cast<std::uint64_t>(st.st_size) : 0;
+      }
+    }
+    auto const removed = is_directory ? remove_tree_at(fd, entry->d_name, bytes)
+                                      : (::unlinkat(fd, entry->d_name, 0) == 0 ? 0 : errno);
+    error = error != 0 ? error : removed;
+  }
+  ::closedir(dir);
+
+  if (::unlinkat(parent, name, AT_REMOVEDIR) != 0)
+  {
+    return error != 0 ? error : errno;
+  }
+  return error;
 }
+#endif
 
-std::vector<tempfile::path_t> get_files_in_directory(tempfile::path_t const & path)
+// Removes the directory `path` with all its contents, returning 0 or the first error.
+[[nodiscard]] int remove_directory(tempfile::path_t const & path, std::uint64_t & bytes)
 {
-  std::vector<tempfile::path_t> files;
-  for (auto const & entry : std::filesystem::directory_iterator(path))
+#ifdef _WIN32
+  std::error_code ec;
+  for (std::filesystem::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec))
   {
-    if (entry.is_regular_file())
+    std::error_code size_ec;
+    if (it->is_regular_file(size_ec))
     {
-      files.push_back(entry.path());
+      auto const size = it->file_size(size_ec);
+      bytes += size_ec ? 0 : size;
     }
   }
-  return files;
+  std::filesystem::remove_all(path, ec);
+  return ec.value();
+#else
+  return remove_tree_at(AT_FDCWD, path.c_str(), bytes);
+#endif
 }
 
+// Whether files created with `strategy` have no name, so closing them is all removal takes.
+[[nodiscard]] bool anonymous(tempfile::strategy strategy)
+{
+  return strategy == tempfile::strategy::unnamed || strategy == tempfile::strategy::memory;
+}
 
-bool remove_file(tempfile::path_t const & path)
+// Closes and removes a temporary file, updating the counters.
+bool discard_file(tempfile::path_t const & path, int & fd, std::uint64_t * removed = nullptr,
+                  tempfile::strategy strategy = tempfile::strategy::exclusive)
 {
-  return std::filesystem::remove(path);
+  std::uint64_t bytes = 0;
+  struct stat st{};
+  if (fd >= 0 && ::fstat(fd, &st) == 0)
+  {
+    bytes = static_cast<std::uint64_t>(st.st_size);
+  }
+  auto const was_open = fd >= 0;
+  close_file(fd);
+  if (anonymous(strategy))
+  {
+    if (!was_open)
+    {
+      return false;
+    }
+    count(counters.removes);
+    count(counters.bytes_removed, bytes);
+    if (removed != nullptr)
+    {
+      *removed = bytes;
+    }
+    return true;
+  }
+  // unlink reports a file that is already gone, so there is no need to probe for it first
+  TEMPFILE_TRACE1(remove_start, path.c_str());
+  auto const error = remove_file(path);
+  TEMPFILE_TRACE3(remove_end, path.c_str(), bytes, error);
+  if (error != 0)
+  {
+    if (error != ENOENT)
+    {
+      count_failure(error);
+    }
+    return false;
+  }
+  count(counters.removes);
+  count(counters.bytes_removed, bytes);
+  if (removed != nullptr)
+  {
+    *removed = bytes;
+  }
+  return true;
 }
 
-bool remove_directory(tempfile::path_t const & path)
+
+#ifndef _WIN32
+// Id of this process, refreshed in forked children, so checking ownership costs no system call.
+static std::atomic<int> current_pid{static_cast<int>(::getpid())};
+#else
+static std::atomic<int> current_pid{::_getpid()};
+#endif
+
+[[nodiscard]] int process_id()
 {
-  return std::filesystem::remove_all(path);
+  return current_pid.load(std::memory_order_relaxed);
 }
 
+// Ordinal of the calling thread, in order of first use.
+[[nodiscard]] unsigned thread_ordinal()
+{
+  static std::atomic<unsigned> next{0};
+  thread_local auto const ordinal = next.fetch_add(1, std::memory_order_relaxed);
+  return ordinal;
+}
 
-[[nodiscard]] int randrange(int _min, int _max)
+// Draws a seed from the system's entropy source, so every process gets its own.
+[[nodiscard]] std::uint64_t draw_seed() noexcept
 {
-  return _min + (std::rand() % (_max - _min));
+  std::uint64_t seed = 0;
+#ifdef __linux__
+  if (::getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == static_cast<ssize_t>(sizeof(seed)))
+  {
+    return seed;
+  }
+#endif
+  try
+  {
+    std::random_device device;
+    seed = (static_cast<std::uint64_t>(device()) << 32) ^ device();
+  }
+  catch (...)
+  {
+    // no entropy source at all: the clock and the pid at least tell processes apart
+    seed = static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+  }
+  return seed ^ (static_cast<std::uint64_t>(process_id()) << 32);
 }
 
-[[nodiscard]] std::string random_name()
+// Seed of random names and of the salts of counter names, drawn again in forked children.
+static std::atomic<std::uint64_t> name_seed{draw_seed()};
+
+// Appends `k` (up to 12) characters derived from `value` and the process's name seed.
+void append_scrambled(name_buffer & name, std::uint64_t value, int const k)
 {
-  static auto characters = "abcdefghijklmnopqrstuvwxyz0123456789_";
-  auto const k = 8;
-  std::string name;
-  name.resize(k);
+  static auto characters = "abcdefghijklmnopqrstuvwxyz0123456789";
+  // splitmix64 finalizer, so consecutive values give unrelated characters
+  auto z = value + name_seed.load(std::memory_order_relaxed) + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  char scrambled[16];
   for (auto i = 0; i < k; ++i)
   {
-    name[i] = characters[randrange(0, 36)];
+    scrambled[i] = characters[z % 36];
+    z /= 36;
+  }
+  name.append(scrambled, static_cast<std::size_t>(k));
+}
+
+// Appends `k` random characters: a generator per thread, seeded by the process, so neither threads
+// nor processes try the same names in the same order, and nothing is shared between threads.
+void append_random(name_buffer & name, int const k = 8)
+{
+  thread_local std::uint64_t draws = 0;
+  // the top bit keeps these apart from the values salts are derived from
+  append_scrambled(name, (std::uint64_t{1} << 63) ^ (static_cast<std::uint64_t>(thread_ordinal()) << 40) ^ draws++, k);
+}
+
+// Appends a name made from the process id (if `with_pid`), the calling thread and a counter of that
+// thread, so no two calls of one process make the same name and no synchronization is needed.
+void append_counter_name(name_buffer & name, tempfile::naming how, bool with_pid)
+{
+  thread_local std::uint64_t counter = 0;
+  char digits[64];
+  auto length = 0;
+  if (with_pid)
+  {
+    length = std::snprintf(digits, sizeof(digits), "%lx.", static_cast<unsigned long>(process_id()));
+  }
+  length += std::snprintf(digits + length, sizeof(digits) - length, "%x.%llx", thread_ordinal(),
+                          static_cast<unsigned long long>(counter++));
+  name.append(digits, static_cast<std::size_t>(length));
+  if (how == tempfile::naming::salted_counter)
+  {
+    name.append(".", 1);
+    append_scrambled(name, (static_cast<std::uint64_t>(thread_ordinal()) << 40) ^ (counter - 1), 4);
+  }
+}
+
+// Length of the longest name append_name() (or, `in_session`, append_session_name()) makes as `how`.
+[[nodiscard]] std::size_t longest_name(tempfile::naming how, bool in_session)
+{
+  if (how == tempfile::naming::random)
+  {
+    // a session names them by its 64-bit index
+    return in_session ? 16 : 8;
+  }
+  // "<thread>.<counter>", after "<pid>." outside a session, and before ".<salt>" when salted
+  std::size_t const counter = in_session ? 8 + 1 + 16 : 8 + 1 + 8 + 1 + 16;
+  return how == tempfile::naming::salted_counter ? counter + 5 : counter;
+}
+
+// Appends a name for a new temporary in a shared base directory, made as `how`.
+void append_name(name_buffer & name, tempfile::naming how)
+{
+  if (how == tempfile::naming::random)
+  {
+    append_random(name);
+  }
+  else
+  {
+    append_counter_name(name, how, true);
   }
-  return name;
 }
 
 
@@ -154,9 +574,9 @@ std::vector<tempfile::path_t> paths_to_try()
   }
 
 #else
-  for(auto const & paths_to_try : {"/tmp", "/var/tmp", "/usr/tmp"})
+  for (auto const & path_to_try : {"/tmp", "/var/tmp", "/usr/tmp"})
   {
-    paths.push_back(path);
+    paths.emplace_back(path_to_try);
   }
 #endif
 
@@ -179,128 +599,2696 @@ std::vector<tempfile::path_t> paths_to_try()
   return paths;
 }
 
+#ifdef __linux__
+// Whether the block device `device` reports itself as rotational; partitions inherit the answer
+// of their parent disk.
+[[nodiscard]] tempfile::storage_kind block_device_kind(dev_t device)
+{
+  auto const sysfs = "/sys/dev/block/" + std::to_string(major(device)) + ":" + std::to_string(minor(device));
+  for (auto const & queue : {"/queue/rotational", "/../queue/rotational"})
+  {
+    std::ifstream rotational(sysfs + queue);
+    int value = 0;
+    if (rotational >> value)
+    {
+      return value == 0 ? tempfile::storage_kind::ssd : tempfile::storage_kind::disk;
+    }
+  }
+  return tempfile::storage_kind::unknown;
+}
+#endif
 
-tempfile::directory::directory(std::string  prefix)
-  : _good(false), _prefix(std::move(prefix))
+[[nodiscard]] tempfile::storage_kind probe_storage(tempfile::path_t const & path)
 {
+#ifdef _WIN32
+  auto root = path.root_path();
+  switch (GetDriveTypeW(root.c_str()))
+  {
+  case DRIVE_RAMDISK:
+    return tempfile::storage_kind::memory;
+  case DRIVE_REMOTE:
+    return tempfile::storage_kind::network;
+  default:
+    return tempfile::storage_kind::unknown;
+  }
+#elif defined(__linux__)
+  struct statfs fs{};
+  struct stat st{};
+  if (::statfs(path.c_str(), &fs) != 0 || ::stat(path.c_str(), &st) != 0)
+  {
+    return tempfile::storage_kind::unknown;
+  }
+  switch (static_cast<unsigned long>(fs.f_type))
+  {
+  case 0x01021994:  // tmpfs
+  case 0x858458f6:  // ramfs
+    return tempfile::storage_kind::memory;
+  case 0x6969:      // nfs
+  case 0x517b:      // smb
+  case 0xff534d42:  // cifs
+  case 0xfe534d42:  // smb2
+  case 0x00c36400:  // ceph
+  case 0x01021997:  // 9p
+  case 0x5346414f:  // afs
+  case 0x73757245:  // coda
+  case 0x0bd00bd0:  // lustre
+    return tempfile::storage_kind::network;
+  default:
+    return block_device_kind(st.st_dev);
+  }
+#else
+  return tempfile::storage_kind::unknown;
+#endif
+}
+
 }
 
-tempfile::directory::~directory()
+tempfile::storage_kind tempfile::storage_of(path_t const & path)
 {
-  remove();
+  // mounts rarely change during the life of a process, so probe every path only once
+  static std::map<path_t, storage_kind> probed;
+  std::scoped_lock lock(probe_mutex);
+  auto found = probed.find(path);
+  if (found == probed.end())
+  {
+    found = probed.emplace(path, probe_storage(path)).first;
+  }
+  return found->second;
 }
 
+namespace
+{
 
-bool tempfile::directory::create()
+// Rank of a storage kind under a policy, lower is tried first; -1 excludes the kind.
+[[nodiscard]] int storage_rank(tempfile::storage_policy policy, tempfile::storage_kind kind)
 {
-  std::scoped_lock lock(mutex);
+  using tempfile::storage_kind;
+  static constexpr storage_kind memory_first[] = {storage_kind::memory, storage_kind::ssd, storage_kind::disk,
+                                                  storage_kind::unknown};
+  static constexpr storage_kind local_first[] = {storage_kind::ssd, storage_kind::disk, storage_kind::unknown,
+                                                 storage_kind::memory};
+  auto const & order = policy == tempfile::storage_policy::memory ? memory_first : local_first;
+  auto const rank = std::find(std::begin(order), std::end(order), kind) - std::begin(order);
+  return rank == static_cast<std::ptrdiff_t>(std::size(order)) ? -1 : static_cast<int>(rank);
+}
 
-  if (!_path.empty() && _good)
+// Free bytes left on the filesystem of `path` once `reserve` bytes are set aside.
+[[nodiscard]] std::uintmax_t headroom(tempfile::path_t const & path, std::uintmax_t reserve)
+{
+  std::error_code ec;
+  auto const info = std::filesystem::space(path, ec);
+  if (ec || info.available == static_cast<std::uintmax_t>(-1) || info.available <= reserve)
   {
-    // TODO: use a specific error message for this.
-    return false;
+    return 0;
   }
-  // get the paths to try
-  auto paths = paths_to_try();
+  return info.available - reserve;
+}
 
-  // try to create a directory
-  for (auto const & path : paths)
+// Memory the process can still use before hitting its cgroup limit (v2 memory.max, or the v1
+// memory controller), over all its ancestors; -1 when unlimited or unknown.
+[[nodiscard]] std::uintmax_t read_cgroup_headroom()
+{
+  auto constexpr unlimited = static_cast<std::uintmax_t>(-1);
+#ifdef __linux__
+  auto const read_value = [](std::string const & file, std::uintmax_t & value)
   {
-    for (auto itry = 0; itry < 100; ++itry)
-    {
-      // create a random string
-      auto random_string = random_name();
-
-      // check if path is long enough
-      if (path.string().length() + path_separator.length() + _prefix.length() + random_string.length() + 1 > max_path_length)
-      {
-        continue;
-      }
+    std::ifstream stream(file);
+    return static_cast<bool>(stream >> value);
+  };
 
-      // create a temporary directory
-      auto path_to_try = path;
-      path_to_try += path_separator;
-      path_to_try += _prefix;
-      path_to_try += random_string;
+  std::ifstream self("/proc/self/cgroup");
+  std::string line;
+  auto headroom = unlimited;
+  while (std::getline(self, line))
+  {
+    // "0::<path>" for cgroup v2, "<id>:<controllers>:<path>" for v1
+    auto const first = line.find(':');
+    auto const second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos)
+    {
+      continue;
+    }
+    auto const controllers = line.substr(first + 1, second - first - 1);
+    tempfile::path_t group = line.substr(second + 1);
+    std::string root, limit_file, usage_file;
+    if (line.compare(0, first, "0") == 0 && controllers.empty())
+    {
+      root = "/sys/fs/cgroup";
+      limit_file = "memory.max";
+      usage_file = "memory.current";
+    }
+    else if (controllers == "memory")
+    {
+      root = "/sys/fs/cgroup/memory";
+      limit_file = "memory.limit_in_bytes";
+      usage_file = "memory.usage_in_bytes";
+    }
+    else
+    {
+      continue;
+    }
 
-      if (directory_exists(path_to_try))
+    // a limit on any ancestor applies too; "max" does not parse and counts as unlimited
+    for (; ; group = group.parent_path())
+    {
+      auto const dir = root + group.string() + "/";
+      std::uintmax_t limit = 0, usage = 0;
+      if (read_value(dir + limit_file, limit) && read_value(dir + usage_file, usage))
       {
-        continue;
+        headroom = std::min(headroom, limit > usage ? limit - usage : 0);
       }
-
-      if (make_directory(path_to_try))
+      if (group == group.parent_path())
       {
-        _path = path_to_try;
-        _good = true;
-        return true;
+        break;
       }
     }
   }
+  return headroom;
+#else
+  return unlimited;
+#endif
+}
+
+static std::atomic<std::uintmax_t> memory_headroom_threshold{64u << 20u};
 
-  // failed to create a directory
-  return false;
 }
 
-bool tempfile::directory::remove()
+void tempfile::set_memory_headroom(std::uintmax_t bytes)
 {
-  std::scoped_lock lock(mutex);
-  if (_good && directory_exists(_path))
+  memory_headroom_threshold = bytes;
+}
+
+namespace
+{
+
+// Whether placing `size` more bytes on tmpfs would leave less cgroup memory than the threshold.
+[[nodiscard]] bool memory_headroom_low(std::uintmax_t size)
+{
+  auto const threshold = memory_headroom_threshold.load(std::memory_order_relaxed);
+  if (threshold == 0)
   {
-    for (auto const & file_path : get_files_in_directory(_path))
+    return false;
+  }
+
+  // usage moves fast but rereading the cgroup files on every creation is not worth it
+  static std::chrono::steady_clock::time_point read_at;
+  static std::uintmax_t headroom = 0;
+  {
+    std::scoped_lock lock(cgroup_mutex);
+    auto const now = std::chrono::steady_clock::now();
+    if (read_at.time_since_epoch().count() == 0 || now - read_at > std::chrono::milliseconds(100))
     {
-      remove_file(file_path);
+      headroom = read_cgroup_headroom();
+      read_at = now;
     }
-    remove_directory(_path);
-    return true;
   }
-  return false;
+  return headroom < threshold || headroom - threshold < size;
 }
 
-
-tempfile::scoped_directory::scoped_directory(std::string prefix)
-  : directory(std::move(prefix))
+// Entries interned by key: made on first use and never freed or moved, so whoever gets one can keep
+// the pointer. `mutex` also guards whatever the owner of the table keeps alongside it.
+template <typename Key, typename T, typename Compare = std::less<>>
+struct intern_table
 {
-  create();
-}
+  // The entry for `key`, made from it on first use; `made` gets a new entry while still locked.
+  template <typename Made>
+  T * intern(Key const & key, Made made)
+  {
+    std::scoped_lock lock(mutex);
+    auto found = index.find(key);
+    if (found == index.end())
+    {
+      auto & entry = entries.emplace_back(key);
+      made(entry);
+      found = index.emplace(key, &entry).first;
+    }
+    return found->second;
+  }
 
-tempfile::scoped_directory::~scoped_directory()
-{
-  remove();
-}
+  T * intern(Key const & key)
+  {
+    return intern(key, [](T &) {});
+  }
 
+  std::mutex mutex;
+  std::deque<T> entries;
+  std::map<Key, T *, Compare> index;
+};
 
-tempfile::file::file(std::string prefix)
-  : _good(false), _prefix(std::move(prefix))
-{
 }
 
-tempfile::file::~file()
+
+struct tempfile::detail::base
 {
-  std::scoped_lock lock(mutex);
-  if (_good && file_exists(_path))
+  explicit base(path_t path_)
+    : path(std::move(path_))
   {
-    remove_file(_path);
   }
-}
 
-bool tempfile::file::remove()
+  path_t const path;
+  std::atomic<long> live{0};
+  std::atomic<std::uint64_t> retries{0};
+  std::uint32_t index = 0;
+  // storage kind, probed on first use; -1 until then
+  std::atomic<int> kind{-1};
+  // fan-out subdirectories found fit for use, one bit per slot
+  std::array<std::atomic<std::uint64_t>, 4> fan_outs{};
+  // the hidden sibling for temporaries placed near this directory, checked on first use;
+  // this base itself if there is none to use
+  std::atomic<base *> hidden{nullptr};
+};
+
+namespace
 {
-  if (_good && file_exists(_path))
-  {
-    remove_file(_path);
+
+// every base directory used so far
+static intern_table<tempfile::path_t, tempfile::detail::base> bases;
+static std::vector<tempfile::detail::base *> striped_bases;
+static tempfile::placement striping = tempfile::placement::round_robin;
+static std::atomic<unsigned> next_stripe{0};
+
+// the same by index, for handles; chunks are filled before their indices are handed out and never
+// freed, so looking an index up takes no lock
+static constexpr std::size_t base_chunk_size = 1024;
+static std::array<std::atomic<tempfile::detail::base **>, 1024> base_chunks{};
+static constexpr std::uint32_t no_base_index = ~0u;
+
+tempfile::detail::base * intern_base(tempfile::path_t const & path)
+{
+  return bases.intern(path, [](tempfile::detail::base & entry)
+  {
+    auto const index = bases.entries.size() - 1;
+    auto const chunk = index / base_chunk_size;
+    entry.index = no_base_index;
+    if (chunk < base_chunks.size())
+    {
+      auto * slots = base_chunks[chunk].load(std::memory_order_relaxed);
+      if (slots == nullptr)
+      {
+        slots = new tempfile::detail::base *[base_chunk_size]();
+        base_chunks[chunk].store(slots, std::memory_order_release);
+      }
+      slots[index % base_chunk_size] = &entry;
+      entry.index = static_cast<std::uint32_t>(index);
+    }
+  });
+}
+
+[[nodiscard]] tempfile::detail::base * base_at(std::uint32_t index)
+{
+  return base_chunks[index / base_chunk_size].load(std::memory_order_acquire)[index % base_chunk_size];
+}
+
+}
+
+void tempfile::set_base_directories(std::vector<path_t> const & paths, placement mode)
+{
+  std::vector<detail::base *> configured;
+  for (auto const & path : paths)
+  {
+    configured.push_back(intern_base(path));
+  }
+  std::scoped_lock lock(bases.mutex);
+  striped_bases = std::move(configured);
+  striping = mode;
+}
+
+namespace
+{
+
+void release_base(tempfile::detail::base *& base, std::atomic<std::int64_t> & live)
+{
+  if (base != nullptr)
+  {
+    base->live.fetch_sub(1, std::memory_order_relaxed);
+    live.fetch_sub(1, std::memory_order_relaxed);
+    base = nullptr;
+  }
+}
+
+// Storage kind of `base`, probed once.
+[[nodiscard]] tempfile::storage_kind kind_of(tempfile::detail::base & base)
+{
+  auto kind = base.kind.load(std::memory_order_relaxed);
+  if (kind < 0)
+  {
+    kind = static_cast<int>(tempfile::storage_of(base.path));
+    base.kind.store(kind, std::memory_order_relaxed);
+  }
+  return static_cast<tempfile::storage_kind>(kind);
+}
+
+// Base directories to try for one creation, in order. The list is kept inline, so choosing the
+// bases allocates nothing; bases past its capacity are left out.
+struct base_list
+{
+  static constexpr std::size_t capacity = 32;
+
+  bool push_back(tempfile::detail::base * base)
+  {
+    if (size == capacity)
+    {
+      return false;
+    }
+    entries[size++] = base;
+    return true;
+  }
+
+  [[nodiscard]] bool empty() const { return size == 0; }
+  [[nodiscard]] tempfile::detail::base * const * begin() const { return entries.data(); }
+  [[nodiscard]] tempfile::detail::base * const * end() const { return entries.data() + size; }
+
+  std::array<tempfile::detail::base *, capacity> entries{};
+  std::size_t size = 0;
+};
+
+// Sorts a few elements in place, keeping the order of equal ones; std::stable_sort would take a
+// buffer from the heap.
+template <typename T, typename Less>
+void sort_few(T * first, T * last, Less less)
+{
+  for (auto * it = first; it != last; ++it)
+  {
+    std::rotate(std::upper_bound(first, it, *it, less), it, it + 1);
+  }
+}
+
+// Orders (and filters) `list` according to the storage policy and size hint in `opts`. With
+// `keep_order`, the size hint only filters, so it does not undo the striping order.
+void rank_bases(base_list & list, tempfile::options const & opts, bool keep_order = false)
+{
+  // tmpfs pages are charged to the memory cgroup, so fall back to disk before they get us killed
+  auto const avoid_memory = memory_headroom_low(opts.size_hint);
+  auto policy = opts.policy;
+  if (policy == tempfile::storage_policy::first && opts.size_hint == 0 && !avoid_memory)
+  {
+    return;
+  }
+  if (policy == tempfile::storage_policy::automatic)
+  {
+    policy = opts.size_hint <= tempfile::small_size ? tempfile::storage_policy::memory
+                                                    : tempfile::storage_policy::local;
+  }
+
+  struct candidate
+  {
+    int rank;
+    std::uintmax_t headroom;
+    tempfile::detail::base * base;
+  };
+  std::array<candidate, base_list::capacity> ranked;
+  std::size_t kept = 0;
+  for (auto * base : list)
+  {
+    auto const kind = policy == tempfile::storage_policy::first && !avoid_memory ? tempfile::storage_kind::unknown
+                                                                                 : kind_of(*base);
+    auto const rank = policy == tempfile::storage_policy::first ? 0 : storage_rank(policy, kind);
+    if (rank < 0 || (avoid_memory && kind == tempfile::storage_kind::memory))
+    {
+      continue;
+    }
+    // skip filesystems that cannot hold the whole temporary, rather than failing once it is mostly written
+    std::uintmax_t room = 0;
+    if (opts.size_hint > 0)
+    {
+      room = headroom(base->path, opts.reserve);
+      if (room < opts.size_hint)
+      {
+        continue;
+      }
+    }
+    ranked[kept++] = {rank, room, base};
+  }
+  // most headroom first within a storage kind, keeping the configured order among equals
+  sort_few(ranked.data(), ranked.data() + kept, [keep_order](auto const & a, auto const & b)
+  {
+    return a.rank < b.rank || (!keep_order && a.rank == b.rank && a.headroom > b.headroom);
+  });
+
+  list.size = 0;
+  for (std::size_t i = 0; i < kept; ++i)
+  {
+    list.push_back(ranked[i].base);
+  }
+}
+
+// Puts the configured base directories into `list`, in the order the placement mode wants them
+// tried; returns whether there are any.
+bool striped_bases_into(base_list & list)
+{
+  tempfile::placement mode;
+  {
+    std::scoped_lock lock(bases.mutex);
+    mode = striping;
+    auto const first = mode == tempfile::placement::round_robin && !striped_bases.empty()
+                       ? next_stripe.fetch_add(1, std::memory_order_relaxed) % striped_bases.size() : 0;
+    for (std::size_t i = 0; i < striped_bases.size(); ++i)
+    {
+      if (!list.push_back(striped_bases[(first + i) % striped_bases.size()]))
+      {
+        break;
+      }
+    }
+  }
+
+  if (mode != tempfile::placement::round_robin)
+  {
+    sort_few(list.entries.data(), list.entries.data() + list.size, [](auto const * a, auto const * b)
+    {
+      return a->live.load(std::memory_order_relaxed) < b->live.load(std::memory_order_relaxed);
+    });
+  }
+  return !list.empty();
+}
+
+// The default candidates, interned once, so the environment is only read on first use.
+[[nodiscard]] base_list const & default_bases()
+{
+  static base_list const defaults = []
+  {
+    base_list list;
+    for (auto const & path : paths_to_try())
+    {
+      list.push_back(intern_base(path));
+    }
+    return list;
+  }();
+  return defaults;
+}
+
+// The configured base directories, or the default candidates if none are configured.
+[[nodiscard]] base_list configured_bases()
+{
+  base_list list;
+  return striped_bases_into(list) ? list : default_bases();
+}
+
+}
+
+
+struct tempfile::detail::tier
+{
+  explicit tier(tempfile::tier config_)
+    : config(config_)
+  {
+  }
+
+  tempfile::tier const config;
+  std::atomic<std::uintmax_t> used{0};
+};
+
+namespace
+{
+
+// tiers are interned by their configuration, so one configured again keeps what is charged to it
+struct tier_order
+{
+  bool operator()(tempfile::tier const & a, tempfile::tier const & b) const
+  {
+    return std::tie(a.kind, a.budget) < std::tie(b.kind, b.budget);
+  }
+};
+
+// every tier configured so far
+static intern_table<tempfile::tier, tempfile::detail::tier, tier_order> tier_states;
+static std::vector<tempfile::detail::tier *> tiers;
+static std::atomic<bool> tiered{false};
+
+}
+
+void tempfile::set_tiers(std::vector<tier> const & configs)
+{
+  std::vector<detail::tier *> configured;
+  for (auto const & config : configs)
+  {
+    configured.push_back(tier_states.intern(config));
+  }
+  std::scoped_lock lock(tier_states.mutex);
+  tiers = std::move(configured);
+  tiered = !tiers.empty();
+}
+
+namespace
+{
+
+// Charges `size` bytes to `tier`, unless that would exceed its budget.
+bool charge_tier(tempfile::detail::tier * tier, std::uintmax_t size)
+{
+  if (tier == nullptr)
+  {
+    return true;
+  }
+  auto used = tier->used.load(std::memory_order_relaxed);
+  do
+  {
+    if (tier->config.budget != 0 && used + size > tier->config.budget)
+    {
+      return false;
+    }
+  }
+  while (!tier->used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+  return true;
+}
+
+void release_tier(tempfile::detail::tier *& tier, std::uintmax_t size)
+{
+  if (tier != nullptr)
+  {
+    tier->used.fetch_sub(size, std::memory_order_relaxed);
+    tier = nullptr;
+  }
+}
+
+// The configured tiers after `current` (all of them for nullptr) with room for `size` more bytes.
+std::vector<tempfile::detail::tier *> tiers_with_room(tempfile::detail::tier const * current, std::uintmax_t size)
+{
+  std::vector<tempfile::detail::tier *> candidates;
+  std::scoped_lock lock(tier_states.mutex);
+  auto first = tiers.begin();
+  if (current != nullptr)
+  {
+    first = std::find(tiers.begin(), tiers.end(), current);
+    first = first == tiers.end() ? first : first + 1;
+  }
+  for (auto it = first; it != tiers.end(); ++it)
+  {
+    auto const budget = (*it)->config.budget;
+    if (budget == 0 || (*it)->used.load(std::memory_order_relaxed) + size <= budget)
+    {
+      candidates.push_back(*it);
+    }
+  }
+  return candidates;
+}
+
+// The tier among `candidates` the base directory `base` belongs to.
+tempfile::detail::tier * tier_of(std::vector<tempfile::detail::tier *> const & candidates, tempfile::detail::base & base)
+{
+  auto const kind = kind_of(base);
+  for (auto * tier : candidates)
+  {
+    if (tier->config.kind == kind)
+    {
+      return tier;
+    }
+  }
+  return nullptr;
+}
+
+// The hidden sibling directory for temporaries placed near `parent`, on device `device`, or null
+// if it cannot be used. It is created private to the user, and only trusted as a directory of
+// this user on the same device, not as a link or directory someone else planted there.
+[[nodiscard]] tempfile::detail::base * hidden_sibling(tempfile::path_t const & parent, dev_t device)
+{
+  auto const hidden = parent / ".tempfile";
+  // it is left in place after use, as other temporaries may be created in it concurrently
+  auto const made = make_directory(hidden);
+  if (made != 0 && made != EEXIST)
+  {
+    return nullptr;
+  }
+#ifdef _WIN32
+  std::error_code ec;
+  struct stat hidden_stat{};
+  if (!std::filesystem::is_directory(std::filesystem::symlink_status(hidden, ec))
+      || ::stat(hidden.string().c_str(), &hidden_stat) != 0 || hidden_stat.st_dev != device)
+  {
+    return nullptr;
+  }
+#else
+  struct stat hidden_stat{};
+  if (::fstatat(AT_FDCWD, hidden.c_str(), &hidden_stat, AT_SYMLINK_NOFOLLOW) != 0
+      || !S_ISDIR(hidden_stat.st_mode) || hidden_stat.st_uid != ::geteuid() || hidden_stat.st_dev != device)
+  {
+    return nullptr;
+  }
+#endif
+  return intern_base(hidden);
+}
+
+// Adds the base directories on the same filesystem as `destination` to `list`, so a temporary
+// created in any of them can be renamed onto the destination without copying data.
+void bases_near(tempfile::path_t const & destination, base_list & list)
+{
+  // the destination itself usually does not exist yet, so anchor on its parent directory
+  auto parent = destination.parent_path();
+  if (parent.empty())
+  {
+    parent = ".";
+  }
+  auto * const near = intern_base(parent);
+
+  // prefer a hidden sibling directory, so temporaries do not show up next to published files;
+  // it is checked once per parent directory
+  auto * hidden = near->hidden.load(std::memory_order_acquire);
+  if (hidden == nullptr)
+  {
+    struct stat parent_stat{};
+    if (::stat(parent.string().c_str(), &parent_stat) != 0)
+    {
+      return;
+    }
+    hidden = hidden_sibling(parent, parent_stat.st_dev);
+    if (hidden == nullptr)
+    {
+      hidden = near;
+    }
+    near->hidden.store(hidden, std::memory_order_release);
+  }
+  if (hidden != near)
+  {
+    list.push_back(hidden);
+  }
+  list.push_back(near);
+}
+
+// Base directories to try for a temporary created with `opts`, best first.
+[[nodiscard]] base_list bases_to_try(tempfile::options const & opts)
+{
+  base_list list;
+  if (!opts.near.empty())
+  {
+    bases_near(opts.near, list);
+    rank_bases(list, opts);
+    return list;
+  }
+  if (striped_bases_into(list))
+  {
+    rank_bases(list, opts, true);
+    return list;
+  }
+  list = default_bases();
+  rank_bases(list, opts);
+  return list;
+}
+
+// Base directories of the tiers in `candidates`, tier by tier: of the configured ones, or of the
+// default candidates plus /dev/shm as memory storage.
+[[nodiscard]] base_list bases_to_try(std::vector<tempfile::detail::tier *> const & candidates,
+                                     tempfile::options opts)
+{
+  base_list configured;
+  if (!striped_bases_into(configured))
+  {
+    configured = default_bases();
+#ifdef __linux__
+    // a memory tier needs a memory-backed candidate, which the defaults may lack
+    static auto * const shm = intern_base("/dev/shm");
+    configured.push_back(shm);
+#endif
+  }
+  base_list list;
+  for (auto const * tier : candidates)
+  {
+    for (auto * base : configured)
+    {
+      if (kind_of(*base) == tier->config.kind)
+      {
+        list.push_back(base);
+      }
+    }
+  }
+  // the tier order replaces the storage policy; the size hint still filters
+  opts.policy = tempfile::storage_policy::first;
+  rank_bases(list, opts, true);
+  return list;
+}
+
+
+// Prefix of the fan-out subdirectories, hidden and distinct from temporary names.
+static std::string const fan_out_prefix = ".tempfile-fan-";
+
+// Prefix of the fan-out subdirectories of this user, so users sharing a base do not lock each
+// other out of theirs.
+static std::string const user_fan_out_prefix = []
+{
+#ifndef _WIN32
+  return fan_out_prefix + std::to_string(::geteuid()) + "-";
+#else
+  return fan_out_prefix;
+#endif
+}();
+
+// Appends the fan-out subdirectory `fan` puts a temporary named `name` in, and a separator;
+// returns whether there is one, and its slot in `slot`.
+bool append_fan_out(path_buffer & path, tempfile::fan_out fan, std::string_view name, unsigned & slot)
+{
+  switch (fan)
+  {
+  case tempfile::fan_out::hashed:
+    slot = static_cast<unsigned>(std::hash<std::string_view>{}(name) & 0xffu);
+    break;
+  case tempfile::fan_out::per_thread:
+    slot = thread_ordinal() & 0xffu;
+    break;
+  default:
+    return false;
+  }
+  char digits[4];
+  std::snprintf(digits, sizeof(digits), "%02x", slot);
+  return path.append(user_fan_out_prefix) && path.append(digits, 2) && path.append(path_separator);
+}
+
+// Makes sure the fan-out subdirectory `slot` of `base`, at `subdirectory`, exists and is a directory
+// of this user's rather than, say, a symlink someone else planted in a shared base; returns 0 or the
+// error. Checked once per subdirectory: in a sticky base like /tmp no one else can replace it later.
+int check_fan_out(tempfile::detail::base & base, unsigned slot, std::string_view subdirectory)
+{
+  auto & checked = base.fan_outs[slot / 64];
+  auto const bit = std::uint64_t{1} << (slot % 64);
+  if ((checked.load(std::memory_order_relaxed) & bit) != 0)
+  {
+    return 0;
+  }
+#ifndef _WIN32
+  path_buffer path;
+  if (!path.append(subdirectory))
+  {
+    return ENAMETOOLONG;
+  }
+  struct stat st{};
+  if (::fstatat(AT_FDCWD, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+  {
+    if (errno != ENOENT)
+    {
+      return errno;
+    }
+    auto const made = make_directory(path.c_str());
+    if (made != 0 && made != EEXIST)
+    {
+      return made;
+    }
+    if (::fstatat(AT_FDCWD, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      return errno;
+    }
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != ::geteuid())
+  {
+    return EPERM;
+  }
+#else
+  auto const made = make_directory(tempfile::path_t(subdirectory));
+  if (made != 0 && made != EEXIST)
+  {
+    return made;
+  }
+#endif
+  checked.fetch_or(bit, std::memory_order_relaxed);
+  return 0;
+}
+
+// Runs `attempt` in the fan-out subdirectory `slot` of `base`, at `subdirectory`, after checking it.
+// One checked earlier may have been removed since (by an age-based cleaner, say), so on ENOENT it is
+// made and checked again and `attempt` retried once.
+template <typename Attempt>
+int attempt_in_fan_out(tempfile::detail::base & base, unsigned slot, std::string_view subdirectory, Attempt attempt)
+{
+  auto error = check_fan_out(base, slot, subdirectory);
+  if (error == 0)
+  {
+    error = attempt();
+  }
+  if (error == ENOENT)
+  {
+    base.fan_outs[slot / 64].fetch_and(~(std::uint64_t{1} << (slot % 64)), std::memory_order_relaxed);
+    error = check_fan_out(base, slot, subdirectory);
+    if (error == 0)
+    {
+      error = attempt();
+    }
+  }
+  return error;
+}
+
+// Runs `attempt`, creating the fan-out subdirectory with `make_subdirectory` and running it again
+// if that is what was missing; probing for the subdirectory first would cost every creation.
+template <typename Attempt, typename MakeSubdirectory>
+int attempt_fanned(bool fanned, Attempt attempt, MakeSubdirectory make_subdirectory)
+{
+  auto error = attempt();
+  if (error == ENOENT && fanned)
+  {
+    auto const made = make_subdirectory();
+    if (made == 0 || made == EEXIST)
+    {
+      error = attempt();
+    }
+  }
+  return error;
+}
+
+
+// Tries random names under each base path until `make` succeeds in creating one of them. `make`
+// returns 0 on success or the error; EEXIST retries another name, other errors the next base path.
+template <typename Make>
+bool create_temporary(std::string const & prefix, base_list const & bases, tempfile::path_t & created,
+                      tempfile::detail::base *& base, std::atomic<std::int64_t> & live, tempfile::naming naming,
+                      tempfile::fan_out fan, Make make)
+{
+  for (auto * entry : bases)
+  {
+    path_buffer candidate;
+    if (!append_directory(candidate, entry->path))
+    {
+      continue;
+    }
+    auto const directory_length = candidate.length;
+    for (auto itry = 0; itry < 100; ++itry)
+    {
+      if (itry > 0)
+      {
+        count(entry->retries);
+      }
+
+      // create a name; counter names only collide with ones left by an earlier process of the same id
+      name_buffer name;
+      append_name(name, naming);
+      TEMPFILE_TRACE1(name_generated, name.c_str());
+
+      // build the candidate path in place, skipping names that make it too long
+      candidate.truncate(directory_length);
+      unsigned slot = 0;
+      auto const fanned = append_fan_out(candidate, fan, name.view(), slot);
+      auto const parent_length = candidate.length - (fanned ? path_separator.size() : 0);
+      if ((fan != tempfile::fan_out::none && !fanned) || !candidate.append(prefix) || !candidate.append(name.view()))
+      {
+        continue;
+      }
+
+      TEMPFILE_TRACE1(create_attempt, candidate.c_str());
+      auto const attempt = [&] { return make(candidate.c_str()); };
+      auto const error = fanned ? attempt_in_fan_out(*entry, slot, std::string_view(candidate.text, parent_length), attempt)
+                                : attempt();
+      if (error == 0)
+      {
+        created = candidate.c_str();
+        base = entry;
+        base->live.fetch_add(1, std::memory_order_relaxed);
+        live.fetch_add(1, std::memory_order_relaxed);
+        count(counters.creates);
+        return true;
+      }
+      if (error != EEXIST)
+      {
+        // no point in trying other names where creating is not possible at all
+        TEMPFILE_TRACE2(create_failed, candidate.c_str(), error);
+        count_failure(error);
+        break;
+      }
+      TEMPFILE_TRACE1(collision, candidate.c_str());
+      count(counters.collisions);
+    }
+  }
+  return false;
+}
+
+
+// Creates a temporary in the first base path where `make` succeeds; for strategies where the
+// system picks the name (or there is none), so a base path is only tried once.
+template <typename Make>
+bool create_in_base(base_list const & bases, tempfile::path_t & created, tempfile::detail::base *& base,
+                    std::atomic<std::int64_t> & live, Make make, tempfile::fan_out fan = tempfile::fan_out::none)
+{
+  for (auto * entry : bases)
+  {
+    auto const & path = entry->path;
+    TEMPFILE_TRACE1(create_attempt, path.c_str());
+    // the system picks the name, so hashing spreads by a random one instead
+    name_buffer random;
+    append_random(random);
+    path_buffer subdirectory;
+    unsigned slot = 0;
+    auto const fanned = append_directory(subdirectory, path) && append_fan_out(subdirectory, fan, random.view(), slot);
+    auto const where = fanned ? tempfile::path_t(subdirectory.c_str()) : path;
+    auto const parent = subdirectory.view().substr(0, subdirectory.length - (fanned ? path_separator.size() : 0));
+    auto const attempt = [&] { return make(where, created); };
+    auto const error = fanned ? attempt_in_fan_out(*entry, slot, parent, attempt) : attempt();
+    if (error == 0)
+    {
+      base = entry;
+      base->live.fetch_add(1, std::memory_order_relaxed);
+      live.fetch_add(1, std::memory_order_relaxed);
+      count(counters.creates);
+      return true;
+    }
+    TEMPFILE_TRACE2(create_failed, path.c_str(), error);
+    count_failure(error);
+  }
+  return false;
+}
+
+// Path under which an open descriptor without a name can still be reached.
+[[nodiscard]] tempfile::path_t descriptor_path(int fd)
+{
+  return "/proc/self/fd/" + std::to_string(fd);
+}
+
+// Creates a temporary file in one of `bases` (unused by the memory strategy) with `strategy`.
+bool create_file(tempfile::strategy strategy, tempfile::naming naming, tempfile::fan_out fan,
+                 std::string const & prefix, base_list const & bases, tempfile::path_t & created,
+                 tempfile::detail::base *& base, int & fd)
+{
+  auto & live = counters.live_files;
+  switch (strategy)
+  {
+#ifndef _WIN32
+  case tempfile::strategy::mkstemp:
+    return create_in_base(bases, created, base, live, [&](tempfile::path_t const & path, tempfile::path_t & name)
+    {
+      auto pattern = (path / (prefix + "XXXXXX")).string();
+      fd = ::mkostemp(pattern.data(), O_CLOEXEC);
+      name = pattern;
+      return fd >= 0 ? 0 : errno;
+    }, fan);
+#endif
+#ifdef __linux__
+  case tempfile::strategy::unnamed:
+    return create_in_base(bases, created, base, live, [&](tempfile::path_t const & path, tempfile::path_t & name)
+    {
+      fd = ::open(path.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+      name = descriptor_path(fd);
+      return fd >= 0 ? 0 : errno;
+    });
+  case tempfile::strategy::memory:
+  {
+    static base_list const descriptors = []
+    {
+      base_list list;
+      list.push_back(intern_base("/proc/self/fd"));
+      return list;
+    }();
+    return create_in_base(descriptors, created, base, live, [&](tempfile::path_t const &, tempfile::path_t & name)
+    {
+      fd = ::memfd_create(prefix.c_str(), MFD_CLOEXEC);
+      name = descriptor_path(fd);
+      return fd >= 0 ? 0 : errno;
+    });
+  }
+#endif
+  case tempfile::strategy::exclusive:
+    // the exclusive open fails on existing names, so no separate existence check is needed
+    return create_temporary(prefix, bases, created, base, live, naming, fan, [&fd](char const * path_to_try)
+    {
+      fd = open_file(path_to_try);
+      return fd >= 0 ? 0 : errno;
+    });
+  default:
+    count_failure(EOPNOTSUPP);
+    return false;
+  }
+}
+
+
+static std::atomic<tempfile::session *> default_session{nullptr};
+
+}
+
+void tempfile::set_default_session(session * s)
+{
+  default_session = s;
+}
+
+namespace
+{
+
+// The session a temporary created with `opts` goes to, if any.
+[[nodiscard]] tempfile::session * session_of(tempfile::options const & opts)
+{
+  if (!opts.near.empty())
+  {
+    return nullptr;
+  }
+  auto * const session = opts.session != nullptr ? opts.session
+                         : opts.bypass_default_session ? nullptr : default_session.load(std::memory_order_acquire);
+  return session != nullptr && session->good() ? session : nullptr;
+}
+
+// Appends the name of a new entry of the root of `session` made as `how`: the session's counter
+// for random naming, which needs no randomness in a private root.
+void append_session_name(name_buffer & name, tempfile::session & session, tempfile::naming how)
+{
+  if (how != tempfile::naming::random)
+  {
+    // the root is private to this process, so the process id adds nothing
+    append_counter_name(name, how, false);
+    return;
+  }
+  char digits[17];
+  auto const length = std::snprintf(digits, sizeof(digits), "%llx", static_cast<unsigned long long>(session.next_index()));
+  name.append(digits, static_cast<std::size_t>(length));
+}
+
+// Creates a temporary named by the session counter in the root of `session`; `make` gets the root
+// descriptor and the name, and returns 0 or the error. Counter names cannot collide with each
+// other, so the retries only cover entries someone else put into the root.
+template <typename Make>
+bool create_in_session(tempfile::session & session, std::string const & prefix, tempfile::path_t & created,
+                       tempfile::detail::base *& base, std::atomic<std::int64_t> & live, tempfile::naming naming,
+                       tempfile::fan_out fan, Make make)
+{
+  auto const root = session.native_handle();
+  path_buffer candidate;
+  if (!append_directory(candidate, session.path()))
+  {
+    return false;
+  }
+  auto const root_length = candidate.length;
+  for (auto itry = 0; itry < 100; ++itry)
+  {
+    name_buffer name;
+    if (!name.append(prefix))
+    {
+      return false;
+    }
+    append_session_name(name, session, naming);
+
+    // the path relative to the root follows the root's in the same buffer
+    candidate.truncate(root_length);
+    unsigned slot = 0;
+    auto const fanned = append_fan_out(candidate, fan, name.view(), slot);
+    if ((fan != tempfile::fan_out::none && !fanned) || !candidate.append(name.view()))
+    {
+      return false;
+    }
+    auto const * relative = candidate.text + root_length;
+    // the root is private to this process, so its subdirectories need no checking
+    auto const error = attempt_fanned(fanned, [&] { return make(root, relative); }, [&]
+    {
+      name_buffer subdirectory;
+      subdirectory.append(relative, user_fan_out_prefix.size() + 2);
+      return ::mkdirat(root, subdirectory.c_str(), 0700) == 0 ? 0 : errno;
+    });
+    if (error == 0)
+    {
+      created = candidate.c_str();
+      base = intern_base(session.path());
+      base->live.fetch_add(1, std::memory_order_relaxed);
+      live.fetch_add(1, std::memory_order_relaxed);
+      count(counters.creates);
+      return true;
+    }
+    if (error != EEXIST)
+    {
+      TEMPFILE_TRACE2(create_failed, candidate.c_str(), error);
+      count_failure(error);
+      return false;
+    }
+    TEMPFILE_TRACE1(collision, candidate.c_str());
+    count(counters.collisions);
+  }
+  return false;
+}
+
+// Where a new temporary goes: into `session`, relative to its root if `at_root`, or else under one
+// of `bases`, the base directories of the tiers in `candidates` if `use_tiers`.
+struct destination
+{
+  tempfile::session * session = nullptr;
+  bool at_root = false;
+  bool use_tiers = false;
+  std::vector<tempfile::detail::tier *> candidates;
+  base_list bases;
+};
+
+// The destination of a temporary created with `opts`; tiers apply if `tierable`, and need `size`
+// bytes of room.
+[[nodiscard]] destination destination_of(tempfile::options const & opts, bool tierable, std::uintmax_t size)
+{
+  destination to;
+  to.session = session_of(opts);
+  to.use_tiers = tierable && tiered && opts.near.empty() && to.session == nullptr;
+  if (to.use_tiers)
+  {
+    to.candidates = tiers_with_room(nullptr, size);
+  }
+  // creating relative to the session root takes no base paths at all
+  to.at_root = to.session != nullptr && to.session->native_handle() >= 0
+               && opts.strategy == tempfile::strategy::exclusive;
+  if (to.at_root)
+  {
+    return to;
+  }
+  if (to.session != nullptr)
+  {
+    to.bases.push_back(intern_base(to.session->path()));
+  }
+  else
+  {
+    to.bases = to.use_tiers ? bases_to_try(to.candidates, opts) : bases_to_try(opts);
+  }
+  if (to.bases.empty())
+  {
+    // every candidate was dropped for lack of room (or tier budget), which is what callers should hear
+    count_failure(ENOSPC);
+  }
+  return to;
+}
+
+}
+
+
+struct tempfile::detail::label
+{
+  explicit label(std::string name_)
+    : name(std::move(name_)), since(std::chrono::steady_clock::now())
+  {
+  }
+
+  std::string const name;
+  std::chrono::steady_clock::time_point const since;
+  std::atomic<std::int64_t> live{0};
+  std::atomic<std::uint64_t> creates{0};
+  std::atomic<std::int64_t> bytes{0};
+  std::atomic<std::uint64_t> bytes_removed{0};
+  std::atomic<std::uint64_t> cleanups{0};
+  std::atomic<std::uint64_t> cleanup_ns{0};
+};
+
+namespace
+{
+
+// every label used so far
+static intern_table<std::string, tempfile::detail::label> labels;
+
+// Counts a new temporary under `name`; unlabeled temporaries are not tracked.
+tempfile::detail::label * acquire_label(std::string const & name)
+{
+  if (name.empty())
+  {
+    return nullptr;
+  }
+  auto * const label = labels.intern(name);
+  label->live.fetch_add(1, std::memory_order_relaxed);
+  count(label->creates);
+  return label;
+}
+
+// Counts the removal of a temporary that held `bytes` written through the library.
+void release_label(tempfile::detail::label *& label, std::uint64_t bytes, std::uint64_t removed)
+{
+  if (label != nullptr)
+  {
+    label->live.fetch_sub(1, std::memory_order_relaxed);
+    label->bytes.fetch_sub(static_cast<std::int64_t>(bytes), std::memory_order_relaxed);
+    count(label->bytes_removed, removed);
+    label = nullptr;
+  }
+}
+
+}
+
+std::vector<tempfile::label_usage> tempfile::usage_by_label()
+{
+  std::vector<label_usage> usage;
+  auto const now = std::chrono::steady_clock::now();
+  std::scoped_lock lock(labels.mutex);
+  for (auto const & label : labels.entries)
+  {
+    label_usage entry;
+    entry.label = label.name;
+    entry.live = static_cast<std::uint64_t>(std::max<std::int64_t>(0, label.live.load(std::memory_order_relaxed)));
+    entry.creates = label.creates.load(std::memory_order_relaxed);
+    auto const seconds = std::chrono::duration<double>(now - label.since).count();
+    entry.creates_per_second = seconds > 0 ? static_cast<double>(entry.creates) / seconds : 0;
+    entry.bytes = static_cast<std::uint64_t>(std::max<std::int64_t>(0, label.bytes.load(std::memory_order_relaxed)));
+    entry.bytes_removed = label.bytes_removed.load(std::memory_order_relaxed);
+    entry.cleanups = label.cleanups.load(std::memory_order_relaxed);
+    entry.cleanup_ns = label.cleanup_ns.load(std::memory_order_relaxed);
+    usage.push_back(std::move(entry));
+  }
+  return usage;
+}
+
+
+namespace
+{
+
+// Log-bucketed latency histogram: four buckets per power of two of nanoseconds, so percentiles
+// are within 25% of the exact value, with lock-free recording.
+struct histogram
+{
+  static constexpr std::size_t sub_buckets = 4;
+
+  std::array<std::atomic<std::uint64_t>, 64 * sub_buckets> buckets{};
+  std::atomic<std::uint64_t> max{0};
+
+  [[nodiscard]] static std::size_t bucket_of(std::uint64_t ns)
+  {
+    if (ns < sub_buckets)
+    {
+      return static_cast<std::size_t>(ns);
+    }
+    auto msb = 0u;
+    for (auto v = ns; v > 1; v >>= 1u)
+    {
+      ++msb;
+    }
+    auto const sub = (ns >> (msb - 2u)) & (sub_buckets - 1);
+    return (msb - 1u) * sub_buckets + sub;
+  }
+
+  // Largest value that falls into bucket `index`.
+  [[nodiscard]] static std::uint64_t upper_bound(std::size_t index)
+  {
+    if (index < sub_buckets)
+    {
+      return index;
+    }
+    auto const msb = index / sub_buckets + 1;
+    auto const sub = index % sub_buckets;
+    return ((sub_buckets + sub + 1) << (msb - 2u)) - 1;
+  }
+
+  void record(std::uint64_t ns)
+  {
+    count(buckets[bucket_of(ns)]);
+    auto seen = max.load(std::memory_order_relaxed);
+    while (ns > seen && !max.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  [[nodiscard]] tempfile::latency_summary summary() const
+  {
+    std::array<std::uint64_t, 64 * sub_buckets> counts{};
+    tempfile::latency_summary result;
+    for (std::size_t i = 0; i < counts.size(); ++i)
+    {
+      counts[i] = buckets[i].load(std::memory_order_relaxed);
+      result.count += counts[i];
+    }
+    result.max_ns = max.load(std::memory_order_relaxed);
+
+    auto const percentile = [&](std::uint64_t per_mille)
+    {
+      auto const rank = (result.count * per_mille + 999) / 1000;
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < counts.size(); ++i)
+      {
+        seen += counts[i];
+        if (seen >= rank && seen > 0)
+        {
+          return std::min(upper_bound(i), result.max_ns);
+        }
+      }
+      return std::uint64_t{0};
+    };
+    result.p50_ns = percentile(500);
+    result.p99_ns = percentile(990);
+    return result;
+  }
+};
+
+static std::array<histogram, 4> histograms;
+
+// Records the time from its construction to its destruction in the histogram of `op`, if `enabled`,
+// and as cleanup time of `label`, if any.
+struct latency_timer
+{
+  explicit latency_timer(tempfile::operation op, bool enabled = true, tempfile::detail::label * label = nullptr)
+    : _histogram(enabled ? &histograms[static_cast<std::size_t>(op)] : nullptr), _label(label),
+      _start(enabled || label != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{})
+  {
+  }
+
+  ~latency_timer()
+  {
+    if (_histogram == nullptr && _label == nullptr)
+    {
+      return;
+    }
+    auto const elapsed = std::chrono::steady_clock::now() - _start;
+    auto const ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    if (_histogram != nullptr)
+    {
+      _histogram->record(ns);
+    }
+    if (_label != nullptr)
+    {
+      count(_label->cleanups);
+      count(_label->cleanup_ns, ns);
+    }
+  }
+
+  latency_timer(latency_timer const &) = delete;
+  latency_timer & operator=(latency_timer const &) = delete;
+
+private:
+  histogram * _histogram;
+  tempfile::detail::label * _label;
+  std::chrono::steady_clock::time_point _start;
+};
+
+}
+
+tempfile::latency_summary tempfile::latency(operation op)
+{
+  return histograms[static_cast<std::size_t>(op)].summary();
+}
+
+namespace
+{
+
+void append_json_string(std::string & json, std::string const & value)
+{
+  json += '"';
+  for (auto const c : value)
+  {
+    if (c == '"' || c == '\\')
+    {
+      json += '\\';
+      json += c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json += escaped;
+    }
+    else
+    {
+      json += c;
+    }
+  }
+  json += '"';
+}
+
+}
+
+std::string tempfile::stats_json()
+{
+  auto const snapshot = stats();
+  std::string json = "{";
+  auto const field = [&json](char const * name, std::uint64_t value)
+  {
+    json += '"';
+    json += name;
+    json += "\":";
+    json += std::to_string(value);
+  };
+  field("creates", snapshot.creates);
+  json += ',';
+  field("removes", snapshot.removes);
+  json += ',';
+  field("collisions", snapshot.collisions);
+  json += ',';
+  field("bytes_removed", snapshot.bytes_removed);
+  json += ',';
+  field("live_files", snapshot.live_files);
+  json += ',';
+  field("live_directories", snapshot.live_directories);
+
+  json += ",\"retries\":{";
+  for (std::size_t i = 0; i < snapshot.retries.size(); ++i)
+  {
+    json += i == 0 ? "" : ",";
+    append_json_string(json, snapshot.retries[i].first.string());
+    json += ':' + std::to_string(snapshot.retries[i].second);
+  }
+  json += "},\"failures\":{";
+  for (std::size_t i = 0; i < snapshot.failures.size(); ++i)
+  {
+    json += i == 0 ? "\"" : ",\"";
+    json += std::to_string(snapshot.failures[i].first) + "\":" + std::to_string(snapshot.failures[i].second);
+  }
+
+  json += "},\"latency\":{";
+  constexpr char const * names[] = {"directory_create", "directory_remove", "file_create", "cleanup"};
+  for (std::size_t i = 0; i < std::size(names); ++i)
+  {
+    auto const summary = latency(static_cast<operation>(i));
+    json += i == 0 ? "\"" : ",\"";
+    json += names[i];
+    json += "\":{";
+    field("count", summary.count);
+    json += ',';
+    field("p50_ns", summary.p50_ns);
+    json += ',';
+    field("p99_ns", summary.p99_ns);
+    json += ',';
+    field("max_ns", summary.max_ns);
+    json += '}';
+  }
+  json += "}}";
+  return json;
+}
+
+tempfile::statistics tempfile::stats()
+{
+  statistics snapshot;
+  snapshot.creates = counters.creates.load(std::memory_order_relaxed);
+  snapshot.removes = counters.removes.load(std::memory_order_relaxed);
+  snapshot.collisions = counters.collisions.load(std::memory_order_relaxed);
+  snapshot.bytes_removed = counters.bytes_removed.load(std::memory_order_relaxed);
+  snapshot.live_files = std::max<std::int64_t>(0, counters.live_files.load(std::memory_order_relaxed));
+  snapshot.live_directories = std::max<std::int64_t>(0, counters.live_directories.load(std::memory_order_relaxed));
+  for (std::size_t error = 0; error < counters.failures.size(); ++error)
+  {
+    auto const failures = counters.failures[error].load(std::memory_order_relaxed);
+    if (failures > 0)
+    {
+      snapshot.failures.emplace_back(static_cast<int>(error), failures);
+    }
+  }
+  std::scoped_lock lock(bases.mutex);
+  for (auto const & base : bases.entries)
+  {
+    snapshot.retries.emplace_back(base.path, base.retries.load(std::memory_order_relaxed));
+  }
+  return snapshot;
+}
+
+
+namespace
+{
+
+// Name of the owner marker written into directories created with options::mark_owner.
+static constexpr char const owner_marker[] = ".tempfile-owner";
+
+#ifndef _WIN32
+// Start time of process `pid` in clock ticks since boot (field 22 of /proc/<pid>/stat), which
+// tells a live owner from an unrelated process that reused its pid; 0 where unknown.
+[[nodiscard]] unsigned long long process_start_time(pid_t pid)
+{
+#ifdef __linux__
+  std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if (!std::getline(stat_file, stat))
+  {
+    return 0;
+  }
+  // the command name (field 2) may contain spaces, so count fields from its closing parenthesis
+  auto const end_of_name = stat.rfind(')');
+  if (end_of_name == std::string::npos)
+  {
+    return 0;
+  }
+  std::istringstream fields(stat.substr(end_of_name + 2));
+  std::string field;
+  for (auto i = 3; i < 22 && fields >> field; ++i)
+  {
+  }
+  unsigned long long start_time = 0;
+  fields >> start_time;
+  return start_time;
+#else
+  (void) pid;
+  return 0;
+#endif
+}
+
+// Marker contents identifying this process: "<pid> <start time>".
+[[nodiscard]] std::string owner_identity()
+{
+  static pid_t cached_pid = 0;
+  static std::string identity;
+  auto const pid = static_cast<pid_t>(process_id());
+  // recomputed in forked children, which are owners of their own
+  if (pid != cached_pid)
+  {
+    identity = std::to_string(pid) + " " + std::to_string(process_start_time(pid)) + "\n";
+    cached_pid = pid;
+  }
+  return identity;
+}
+
+// Whether the owner recorded in a marker still runs.
+[[nodiscard]] bool owner_alive(std::string const & marker)
+{
+  std::istringstream fields(marker);
+  long long pid = 0;
+  unsigned long long start_time = 0;
+  if (!(fields >> pid >> start_time) || pid <= 0)
+  {
+    // not a marker we wrote, leave it alone
+    return true;
+  }
+  if (::kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH)
+  {
+    return false;
+  }
+  auto const current_start_time = process_start_time(static_cast<pid_t>(pid));
+  return start_time == 0 || current_start_time == 0 || current_start_time == start_time;
+}
+#endif
+
+void write_owner_marker(tempfile::path_t const & directory)
+{
+#ifndef _WIN32
+  auto const identity = owner_identity();
+  auto fd = ::open((directory / owner_marker).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0 || !write_all(fd, identity.data(), identity.size()))
+  {
+    count_failure(errno);
+  }
+  close_file(fd);
+#else
+  (void) directory;
+#endif
+}
+
+#ifndef _WIN32
+// Removes the orphans among the entries starting with `prefix` of the directory open as `dir_fd`,
+// and of its fan-out subdirectories; takes over `dir_fd`.
+std::size_t sweep_directory(int dir_fd, std::string const & prefix)
+{
+  std::size_t swept = 0;
+  auto * dir = ::fdopendir(dir_fd);
+  if (dir == nullptr)
+  {
+    ::close(dir_fd);
+    return swept;
+  }
+
+  // collect first, removing while reading the same directory stream would skip entries
+  std::vector<std::string> orphans;
+  std::vector<std::string> fanned;
+  while (auto const * entry = ::readdir(dir))
+  {
+    if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+    {
+      continue;
+    }
+    if (std::strncmp(entry->d_name, fan_out_prefix.c_str(), fan_out_prefix.size()) == 0)
+    {
+      fanned.emplace_back(entry->d_name);
+      continue;
+    }
+    if (std::strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0)
+    {
+      continue;
+    }
+    // only directories carrying a marker are ours to judge
+    auto const marker_fd = ::openat(dir_fd, (std::string(entry->d_name) + "/" + owner_marker).c_str(),
+                                    O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (marker_fd < 0)
+    {
+      continue;
+    }
+    char marker[64] = {};
+    auto const got = ::read(marker_fd, marker, sizeof(marker) - 1);
+    ::close(marker_fd);
+    if (got > 0 && !owner_alive(marker))
+    {
+      orphans.emplace_back(entry->d_name);
+    }
+  }
+
+  for (auto const & name : orphans)
+  {
+    std::uint64_t bytes = 0;
+    auto const error = remove_tree_at(dir_fd, name.c_str(), bytes);
+    count(counters.bytes_removed, bytes);
+    if (error == 0)
+    {
+      count(counters.removes);
+      ++swept;
+    }
+    else if (error != ENOENT)
+    {
+      count_failure(error);
+    }
+  }
+  for (auto const & name : fanned)
+  {
+    // only this user's own subdirectories, not ones someone else put there
+    auto const sub_fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st{};
+    if (sub_fd >= 0 && ::fstat(sub_fd, &st) == 0 && st.st_uid == ::geteuid())
+    {
+      swept += sweep_directory(sub_fd, prefix);
+    }
+    else if (sub_fd >= 0)
+    {
+      ::close(sub_fd);
+    }
+  }
+  ::closedir(dir);
+  return swept;
+}
+#endif
+
+}
+
+std::size_t tempfile::sweep_orphans(std::string const & prefix)
+{
+  std::size_t swept = 0;
+#ifndef _WIN32
+  auto configured = configured_bases();
+  // bases are interned, so the same directory listed twice is the same entry
+  std::sort(configured.entries.begin(), configured.entries.begin() + configured.size);
+  configured.size = std::unique(configured.entries.begin(), configured.entries.begin() + configured.size)
+                    - configured.entries.begin();
+
+  for (auto const * base : configured)
+  {
+    auto const base_fd = ::open(base->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd >= 0)
+    {
+      swept += sweep_directory(base_fd, prefix);
+    }
+  }
+#else
+  (void) prefix;
+#endif
+  return swept;
+}
+
+
+// Entry of the registry of live temporaries. Entries are never freed, only recycled, so a signal
+// handler can walk them without locks; `path` is written before `live` is set.
+struct tempfile::detail::registration
+{
+  std::atomic<bool> live{false};
+  // set by whoever removes the temporary first: its owner, cleanup_all() or the signal handler
+  std::atomic<bool> removed{false};
+  bool directory = false;
+  char * path = nullptr;
+  std::size_t capacity = 0;
+  std::size_t shard = 0;
+  registration * next = nullptr;       // every entry of the shard
+  registration * next_free = nullptr;
+};
+
+namespace
+{
+
+// Registry shards, picked by the creating thread so creations rarely meet on a lock.
+struct registry_shard
+{
+  std::mutex mutex;
+  std::atomic<tempfile::detail::registration *> all{nullptr};
+  tempfile::detail::registration * free = nullptr;
+};
+
+static std::array<registry_shard, 16> registry;
+
+// Registers the live temporary `path`, to be removed by cleanup_all() unless its owner does first.
+[[nodiscard]] tempfile::detail::registration * enroll(tempfile::path_t const & path, bool directory)
+{
+  auto const index = thread_ordinal() % registry.size();
+  auto & shard = registry[index];
+  tempfile::detail::registration * entry = nullptr;
+  {
+    std::scoped_lock lock(shard.mutex);
+    if (shard.free != nullptr)
+    {
+      entry = shard.free;
+      shard.free = entry->next_free;
+    }
+  }
+  auto const fresh = entry == nullptr;
+  if (fresh)
+  {
+    entry = new tempfile::detail::registration;
+    entry->shard = index;
+  }
+
+#ifdef _WIN32
+  auto const name = path.string();
+#else
+  auto const & name = path.native();
+#endif
+  if (entry->capacity < name.size() + 1)
+  {
+    // room for the usual lengths up front, so recycled entries rarely grow again
+    delete[] entry->path;
+    entry->capacity = std::max<std::size_t>(256, name.size() + 1);
+    entry->path = new char[entry->capacity];
+  }
+  std::memcpy(entry->path, name.c_str(), name.size() + 1);
+  entry->directory = directory;
+  entry->removed.store(false, std::memory_order_relaxed);
+  entry->live.store(true, std::memory_order_release);
+
+  if (fresh)
+  {
+    std::scoped_lock lock(shard.mutex);
+    entry->next = shard.all.load(std::memory_order_relaxed);
+    shard.all.store(entry, std::memory_order_release);
+  }
+  return entry;
+}
+
+// Unregisters a temporary about to be removed by its owner; returns whether the owner still has to
+// remove it, i.e. no cleanup got to it first.
+bool withdraw(tempfile::detail::registration *& entry)
+{
+  if (entry == nullptr)
+  {
+    return true;
+  }
+  auto const claimed = !entry->removed.exchange(true, std::memory_order_acq_rel);
+  entry->live.store(false, std::memory_order_release);
+  auto & shard = registry[entry->shard];
+  {
+    std::scoped_lock lock(shard.mutex);
+    entry->next_free = shard.free;
+    shard.free = entry;
+  }
+  entry = nullptr;
+  return claimed;
+}
+
+// What letting go of a temporary takes in this process.
+enum class disposal
+{
+  remove,  // remove it
+  defer,   // leave it to its session, see session::keep_until_exit
+  disown,  // leave it alone, it belongs to the process this one was forked from
+};
+
+[[nodiscard]] disposal disposal_of(int owner_pid, bool deferred)
+{
+  return owner_pid != process_id() ? disposal::disown : deferred ? disposal::defer : disposal::remove;
+}
+
+// discard_file() for a registered temporary, which a cleanup may have removed already; one not
+// to be removed here is only closed.
+bool discard_registered(tempfile::path_t const & path, int & fd, tempfile::detail::registration *& entry,
+                        std::uint64_t * removed, tempfile::strategy strategy, disposal how)
+{
+  if (how != disposal::remove)
+  {
+    withdraw(entry);
+    close_file(fd);
+    if (how == disposal::defer)
+    {
+      TEMPFILE_TRACE1(remove_deferred, path.c_str());
+    }
+    return how == disposal::defer;
+  }
+  if (withdraw(entry))
+  {
+    return discard_file(path, fd, removed, strategy);
+  }
+  close_file(fd);
+  return false;
+}
+
+}
+
+std::size_t tempfile::cleanup_all()
+{
+  struct doomed
+  {
+    std::string parent;
+    std::string name;
+    bool directory;
+  };
+  std::vector<doomed> all;
+  for (auto & shard : registry)
+  {
+    // the lock keeps the entries from being recycled while their paths are read
+    std::scoped_lock lock(shard.mutex);
+    for (auto * entry = shard.all.load(std::memory_order_acquire); entry != nullptr; entry = entry->next)
+    {
+      if (entry->live.load(std::memory_order_acquire) && !entry->removed.exchange(true, std::memory_order_acq_rel))
+      {
+        path_t const path(entry->path);
+        all.push_back({path.parent_path().string(), path.filename().string(), entry->directory});
+      }
+    }
+  }
+
+  // group by parent, deeper parents first so session children go before their root
+  std::sort(all.begin(), all.end(), [](doomed const & a, doomed const & b) { return a.parent > b.parent; });
+
+  std::size_t removed = 0;
+  for (auto it = all.begin(); it != all.end();)
+  {
+    auto const group_end = std::find_if(it, all.end(), [&it](doomed const & d) { return d.parent != it->parent; });
+#ifndef _WIN32
+    auto const parent_fd = ::open(it->parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+    for (; it != group_end; ++it)
+    {
+      std::uint64_t bytes = 0;
+#ifndef _WIN32
+      auto error = parent_fd < 0 ? errno : 0;
+      if (error == 0 && it->directory)
+      {
+        error = remove_tree_at(parent_fd, it->name.c_str(), bytes);
+      }
+      else if (error == 0)
+      {
+        struct stat st{};
+        if (::fstatat(parent_fd, it->name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+          bytes = static_cast<std::uint64_t>(st.st_size);
+        }
+        error = ::unlinkat(parent_fd, it->name.c_str(), 0) == 0 ? 0 : errno;
+      }
+#else
+      auto const path = path_t(it->parent) / it->name;
+      auto const error = it->directory ? remove_directory(path, bytes) : remove_file(path);
+#endif
+      count(counters.bytes_removed, bytes);
+      if (error == 0)
+      {
+        count(counters.removes);
+        ++removed;
+      }
+      else if (error != ENOENT)
+      {
+        count_failure(error);
+      }
+    }
+#ifndef _WIN32
+    if (parent_fd >= 0)
+    {
+      ::close(parent_fd);
+    }
+#endif
+  }
+  return removed;
+}
+
+static std::atomic<bool> cleanup_at_exit{false};
+
+void tempfile::set_cleanup_at_exit(bool enable)
+{
+  static std::once_flag registered;
+  cleanup_at_exit = enable;
+  if (enable)
+  {
+    std::call_once(registered, []
+    {
+      std::atexit([]
+      {
+        if (cleanup_at_exit)
+        {
+          cleanup_all();
+        }
+      });
+    });
+  }
+}
+
+#ifndef _WIN32
+namespace
+{
+
+// Removes the directory `name` under `parent` with its contents using async-signal-safe calls only;
+// returns whether the directory is gone.
+bool remove_tree_in_handler(int parent, char const * name)
+{
+#ifdef __linux__
+  auto const fd = ::openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    // readdir may allocate, so read the raw entries; removing while reading can skip some, so go
+    // over the directory again until a pass removes nothing (entries that cannot be removed, e.g.
+    // for lack of permission, must not keep it going)
+    alignas(struct dirent64) char buffer[2048];
+    auto again = true;
+    while (again)
+    {
+      again = false;
+      ::lseek(fd, 0, SEEK_SET);
+      long got;
+      while ((got = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+      {
+        for (long offset = 0; offset < got;)
+        {
+          auto const * entry = reinterpret_cast<struct dirent64 const *>(buffer + offset);
+          offset += entry->d_reclen;
+          if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+          {
+            continue;
+          }
+          auto removed = entry->d_type != DT_DIR && ::unlinkat(fd, entry->d_name, 0) == 0;
+          if (!removed && (entry->d_type == DT_DIR || errno == EISDIR))
+          {
+            removed = remove_tree_in_handler(fd, entry->d_name);
+          }
+          again = again || removed;
+        }
+      }
+    }
+    ::close(fd);
+  }
+#endif
+  return ::unlinkat(parent, name, AT_REMOVEDIR) == 0;
+}
+
+static constexpr int fatal_signals[] = {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV, SIGTERM, SIGINT, SIGHUP, SIGQUIT};
+static struct sigaction previous_actions[std::size(fatal_signals)];
+static bool taken_over[std::size(fatal_signals)] = {};
+static bool handling_signals = false;
+
+void cleanup_on_signal(int signal)
+{
+  auto const saved_errno = errno;
+  for (auto & shard : registry)
+  {
+    for (auto * entry = shard.all.load(std::memory_order_acquire); entry != nullptr; entry = entry->next)
+    {
+      if (entry->live.load(std::memory_order_acquire) && !entry->removed.exchange(true, std::memory_order_acq_rel))
+      {
+        if (entry->directory)
+        {
+          remove_tree_in_handler(AT_FDCWD, entry->path);
+        }
+        else
+        {
+          ::unlink(entry->path);
+        }
+      }
+    }
+  }
+
+  // SA_RESETHAND put the default action back and SA_NODEFER leaves the signal unblocked, so raising
+  // it again ends the process now; a fault would recur on return anyway, a sent signal would not
+  errno = saved_errno;
+  ::raise(signal);
+}
+
+}
+#endif
+
+void tempfile::set_cleanup_on_signals(bool enable)
+{
+#ifndef _WIN32
+  std::scoped_lock lock(cleanup_mutex);
+  if (enable == handling_signals)
+  {
+    return;
+  }
+  for (std::size_t i = 0; i < std::size(fatal_signals); ++i)
+  {
+    if (enable)
+    {
+      // only signals that would end the process are ours to take; ignored ones and those the
+      // application handles may well not, and their temporaries must survive them
+      taken_over[i] = ::sigaction(fatal_signals[i], nullptr, &previous_actions[i]) == 0
+                      && (previous_actions[i].sa_flags & SA_SIGINFO) == 0 && previous_actions[i].sa_handler == SIG_DFL;
+      if (taken_over[i])
+      {
+        struct sigaction action{};
+        action.sa_handler = cleanup_on_signal;
+        action.sa_flags = SA_RESETHAND | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(fatal_signals[i], &action, nullptr);
+      }
+    }
+    else if (taken_over[i])
+    {
+      // leave the action alone if the application has replaced it since
+      struct sigaction current{};
+      if (::sigaction(fatal_signals[i], nullptr, &current) == 0 && (current.sa_flags & SA_SIGINFO) == 0
+          && current.sa_handler == cleanup_on_signal)
+      {
+        ::sigaction(fatal_signals[i], &previous_actions[i], nullptr);
+      }
+      taken_over[i] = false;
+    }
+  }
+  handling_signals = enable;
+#else
+  (void) enable;
+#endif
+}
+
+
+#ifndef _WIN32
+namespace
+{
+
+// Locks held across fork(), in the order they may nest, so a child never inherits one taken by a
+// thread that does not exist there.
+void before_fork()
+{
+  mutex.lock();
+  probe_mutex.lock();
+  bases.mutex.lock();
+  tier_states.mutex.lock();
+  cgroup_mutex.lock();
+  labels.mutex.lock();
+  cleanup_mutex.lock();
+  for (auto & shard : registry)
+  {
+    shard.mutex.lock();
+  }
+}
+
+void after_fork()
+{
+  for (auto it = registry.rbegin(); it != registry.rend(); ++it)
+  {
+    it->mutex.unlock();
+  }
+  cleanup_mutex.unlock();
+  labels.mutex.unlock();
+  cgroup_mutex.unlock();
+  tier_states.mutex.unlock();
+  bases.mutex.unlock();
+  probe_mutex.unlock();
+  mutex.unlock();
+}
+
+// The child owns none of the temporaries it inherited: it neither removes them when their objects
+// go nor in cleanup_all() or on a signal.
+void after_fork_in_child()
+{
+  current_pid = static_cast<int>(::getpid());
+  name_seed = draw_seed();
+  for (auto & shard : registry)
+  {
+    for (auto * entry = shard.all.load(std::memory_order_relaxed); entry != nullptr; entry = entry->next)
+    {
+      entry->removed.store(true, std::memory_order_relaxed);
+    }
+  }
+  after_fork();
+}
+
+[[maybe_unused]] static int const fork_handlers = ::pthread_atfork(before_fork, after_fork, after_fork_in_child);
+
+}
+#endif
+
+tempfile::directory::directory(std::string prefix, options opts)
+  : _good(false), _prefix(std::move(prefix)), _options(std::move(opts))
+{
+}
+
+tempfile::directory::directory(directory && other) noexcept
+  : _good(std::exchange(other._good, false)), _prefix(std::move(other._prefix)), _options(std::move(other._options)),
+    _path(std::exchange(other._path, {})), _base(std::exchange(other._base, nullptr)),
+    _tier(std::exchange(other._tier, nullptr)), _label(std::exchange(other._label, nullptr)),
+    _registration(std::exchange(other._registration, nullptr)), _deferred(std::exchange(other._deferred, false)),
+    _owner_pid(std::exchange(other._owner_pid, 0))
+{
+}
+
+tempfile::directory & tempfile::directory::operator=(directory && other) noexcept
+{
+  if (this != &other)
+  {
+    remove();
+    _good = std::exchange(other._good, false);
+    _prefix = std::move(other._prefix);
+    _options = std::move(other._options);
+    _path = std::exchange(other._path, {});
+    _base = std::exchange(other._base, nullptr);
+    _tier = std::exchange(other._tier, nullptr);
+    _label = std::exchange(other._label, nullptr);
+    _registration = std::exchange(other._registration, nullptr);
+    _deferred = std::exchange(other._deferred, false);
+    _owner_pid = std::exchange(other._owner_pid, 0);
+  }
+  return *this;
+}
+
+tempfile::directory::~directory() noexcept
+{
+  latency_timer timer(operation::cleanup, _base != nullptr);
+  remove();
+}
+
+
+bool tempfile::directory::create()
+{
+  latency_timer timer(operation::directory_create);
+  std::scoped_lock lock(mutex);
+
+  if (!_path.empty() && _good)
+  {
+    // TODO: use a specific error message for this.
+    return false;
+  }
+
+  // directories are charged their size hint, as the library does not see what is written to them
+  auto const to = destination_of(_options, true, _options.size_hint);
+
+  // try to create a directory
+  auto & live = counters.live_directories;
+  switch (_options.strategy)
+  {
+  case strategy::exclusive:
+#ifndef _WIN32
+    if (to.at_root)
+    {
+      _good = create_in_session(*to.session, _prefix, _path, _base, live, _options.naming, _options.fan_out, [](int root, char const * name)
+      {
+        return ::mkdirat(root, name, 0700) == 0 ? 0 : errno;
+      });
+      break;
+    }
+#endif
+    _good = create_temporary(_prefix, to.bases, _path, _base, live, _options.naming, _options.fan_out, [](char const * path_to_try)
+    {
+      // mkdir reports existing names, so there is no need to probe for them first
+      return make_directory(path_to_try);
+    });
+    break;
+#ifndef _WIN32
+  case strategy::mkstemp:
+    _good = create_in_base(to.bases, _path, _base, live, [this](path_t const & path, path_t & name)
+    {
+      auto pattern = (path / (_prefix + "XXXXXX")).string();
+      auto const made = ::mkdtemp(pattern.data()) != nullptr;
+      name = pattern;
+      return made ? 0 : errno;
+    }, _options.fan_out);
+    break;
+#endif
+  default:
+    // there are no unnamed or memory directories
+    count_failure(EOPNOTSUPP);
+    _good = false;
+  }
+
+  if (_good)
+  {
+    if (_options.mark_owner)
+    {
+      write_owner_marker(_path);
+    }
+    _registration = enroll(_path, true);
+    _deferred = to.session != nullptr && to.session->keeps_until_exit();
+    _owner_pid = process_id();
+    _label = acquire_label(_options.label);
+    _tier = to.use_tiers ? tier_of(to.candidates, *_base) : nullptr;
+    if (!charge_tier(_tier, _options.size_hint))
+    {
+      // lost a race for the last of the budget; keep the directory, it is just not accounted
+      _tier = nullptr;
+    }
+  }
+  return _good;
+}
+
+bool tempfile::directory::remove() noexcept
+{
+  std::scoped_lock lock(mutex);
+  auto * const label = _label;
+  auto const live = _base != nullptr;
+  release_base(_base, counters.live_directories);
+  release_tier(_tier, _options.size_hint);
+  release_label(_label, 0, 0);
+  auto const how = disposal_of(_owner_pid, _deferred);
+  if (_good && live && how != disposal::remove)
+  {
+    // left for the session to remove along with its root, or to the parent process
+    withdraw(_registration);
+    if (how == disposal::defer)
+    {
+      TEMPFILE_TRACE1(remove_deferred, _path.c_str());
+    }
+    return how == disposal::defer;
+  }
+  // a tree already removed by cleanup_all() is not removed again
+  if (_good && live && withdraw(_registration))
+  {
+    latency_timer timer(operation::directory_remove, true, label);
+    std::uint64_t bytes = 0;
+    TEMPFILE_TRACE1(remove_start, _path.c_str());
+    auto const error = remove_directory(_path, bytes);
+    TEMPFILE_TRACE3(remove_end, _path.c_str(), bytes, error);
+    count(counters.bytes_removed, bytes);
+    if (label != nullptr)
+    {
+      count(label->bytes_removed, bytes);
+    }
+    if (error != 0)
+    {
+      // a tree removed behind our back is not a failure
+      if (error != ENOENT)
+      {
+        count_failure(error);
+      }
+      return false;
+    }
+    count(counters.removes);
     return true;
   }
   return false;
 }
 
-tempfile::scoped_file::scoped_file(std::string prefix)
-  : file(std::move(prefix))
+
+bool tempfile::directory::create(std::error_code & ec)
+{
+  // all names taken, or the directory was created already
+  return reporting(ec, EEXIST, [this] { return create(); });
+}
+
+bool tempfile::directory::remove(std::error_code & ec) noexcept
+{
+  // a tree already gone, or never created, leaves nothing to report
+  return reporting(ec, 0, [this] { return remove(); });
+}
+
+
+tempfile::scoped_directory::scoped_directory(std::string prefix, options opts)
+  : directory(std::move(prefix), std::move(opts))
+{
+  create();
+}
+
+tempfile::scoped_directory::~scoped_directory() noexcept
+{
+  // ~directory() removes it
+}
+
+
+tempfile::file::file(std::string prefix, options opts)
+  : _good(false), _prefix(std::move(prefix)), _options(std::move(opts))
+{
+}
+
+tempfile::file::file(file && other) noexcept
+  : _good(std::exchange(other._good, false)), _prefix(std::move(other._prefix)), _options(std::move(other._options)),
+    _path(std::exchange(other._path, {})), _fd(std::exchange(other._fd, -1)), _size(std::exchange(other._size, 0)),
+    _base(std::exchange(other._base, nullptr)), _tier(std::exchange(other._tier, nullptr)),
+    _label(std::exchange(other._label, nullptr)), _registration(std::exchange(other._registration, nullptr)),
+    _deferred(std::exchange(other._deferred, false)), _owner_pid(std::exchange(other._owner_pid, 0))
+{
+}
+
+tempfile::file & tempfile::file::operator=(file && other) noexcept
+{
+  if (this != &other)
+  {
+    remove();
+    close_file(_fd);
+    _good = std::exchange(other._good, false);
+    _prefix = std::move(other._prefix);
+    _options = std::move(other._options);
+    _path = std::exchange(other._path, {});
+    _fd = std::exchange(other._fd, -1);
+    _size = std::exchange(other._size, 0);
+    _base = std::exchange(other._base, nullptr);
+    _tier = std::exchange(other._tier, nullptr);
+    _label = std::exchange(other._label, nullptr);
+    _registration = std::exchange(other._registration, nullptr);
+    _deferred = std::exchange(other._deferred, false);
+    _owner_pid = std::exchange(other._owner_pid, 0);
+  }
+  return *this;
+}
+
+tempfile::file::~file() noexcept
+{
+  latency_timer timer(operation::cleanup, _base != nullptr, _label);
+  std::scoped_lock lock(mutex);
+  auto const live = _base != nullptr;
+  release_base(_base, counters.live_files);
+  release_tier(_tier, _size);
+  std::uint64_t removed = 0;
+  if (_good && live)
+  {
+    discard_registered(_path, _fd, _registration, &removed, _options.strategy, disposal_of(_owner_pid, _deferred));
+  }
+  release_label(_label, _size, removed);
+}
+
+bool tempfile::file::create()
+{
+  latency_timer timer(operation::file_create);
+  std::scoped_lock lock(mutex);
+
+  if (!_path.empty() && _good)
+  {
+    return false;
+  }
+
+  // files are charged as they are written, and memory files live outside any base directory
+  auto const to = destination_of(_options, _options.strategy != strategy::memory, 0);
+
+#ifndef _WIN32
+  if (to.at_root)
+  {
+    _good = create_in_session(*to.session, _prefix, _path, _base, counters.live_files, _options.naming, _options.fan_out, [this](int root, char const * name)
+    {
+      _fd = ::openat(root, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      return _fd >= 0 ? 0 : errno;
+    });
+  }
+  else
+#endif
+  {
+    _good = create_file(_options.strategy, _options.naming, _options.fan_out, _prefix, to.bases, _path, _base, _fd);
+  }
+  if (_good)
+  {
+    _registration = anonymous(_options.strategy) ? nullptr : enroll(_path, false);
+    _deferred = to.session != nullptr && to.session->keeps_until_exit() && !anonymous(_options.strategy);
+    _owner_pid = process_id();
+    _label = acquire_label(_options.label);
+    _tier = to.use_tiers ? tier_of(to.candidates, *_base) : nullptr;
+    if (_options.inheritable)
+    {
+      set_inheritable(true);
+    }
+  }
+  return _good;
+}
+
+bool tempfile::file::write(void const * data, std::size_t size)
+{
+  if (!_good || _fd < 0)
+  {
+    return false;
+  }
+  if (!charge_tier(_tier, size) && !demote(size))
+  {
+    count_failure(ENOSPC);
+    return false;
+  }
+  if (!write_all(_fd, static_cast<char const *>(data), size))
+  {
+    count_failure(errno);
+    if (_tier != nullptr)
+    {
+      _tier->used.fetch_sub(size, std::memory_order_relaxed);
+    }
+    return false;
+  }
+  _size += size;
+  if (_label != nullptr)
+  {
+    _label->bytes.fetch_add(static_cast<std::int64_t>(size), std::memory_order_relaxed);
+  }
+  return true;
+}
+
+// Moves the file to the next tier with room for its contents plus `size` more bytes, charging both
+// there, so the pending write can go ahead.
+bool tempfile::file::demote(std::uintmax_t size)
+{
+  std::scoped_lock lock(mutex);
+
+  auto const needed = _size + size;
+  auto const candidates = tiers_with_room(_tier, needed);
+  path_t path;
+  detail::base * base = nullptr;
+  int fd = -1;
+  if (!create_file(_options.strategy, _options.naming, _options.fan_out, _prefix, bases_to_try(candidates, _options),
+                   path, base, fd))
+  {
+    return false;
+  }
+
+  auto * tier = tier_of(candidates, *base);
+  if (!charge_tier(tier, needed))
+  {
+    tier = nullptr;
+  }
+  if (tier == nullptr || !copy_contents(_fd, fd, _size))
+  {
+    release_tier(tier, needed);
+    release_base(base, counters.live_files);
+    discard_file(path, fd, nullptr, _options.strategy);
+    return false;
+  }
+
+  // swap the new copy in and drop the old one
+  release_tier(_tier, _size);
+  release_base(_base, counters.live_files);
+  discard_registered(_path, _fd, _registration, nullptr, _options.strategy, disposal_of(_owner_pid, _deferred));
+  _path = std::move(path);
+  _registration = anonymous(_options.strategy) ? nullptr : enroll(_path, false);
+  _fd = fd;
+  if (_options.inheritable)
+  {
+    set_inheritable(true);
+  }
+  _base = base;
+  _tier = tier;
+  return true;
+}
+
+bool tempfile::file::create(std::error_code & ec)
+{
+  // all names taken, or the file was created already
+  return reporting(ec, EEXIST, [this] { return create(); });
+}
+
+bool tempfile::file::remove(std::error_code & ec) noexcept
+{
+  // a file already gone, or never created, leaves nothing to report
+  return reporting(ec, 0, [this] { return remove(); });
+}
+
+bool tempfile::file::write(void const * data, std::size_t size, std::error_code & ec)
+{
+  return reporting(ec, EBADF, [&] { return write(data, size); });
+}
+
+bool tempfile::file::set_inheritable(bool inheritable)
+{
+#ifndef _WIN32
+  auto const flags = _fd >= 0 ? ::fcntl(_fd, F_GETFD) : -1;
+  if (flags < 0)
+  {
+    return false;
+  }
+  auto const wanted = inheritable ? flags & ~FD_CLOEXEC : flags | FD_CLOEXEC;
+  return wanted == flags || ::fcntl(_fd, F_SETFD, wanted) == 0;
+#else
+  (void) inheritable;
+  return false;
+#endif
+}
+
+bool tempfile::file::remove() noexcept
+{
+  latency_timer timer(operation::cleanup, false, _label);
+  auto const live = _base != nullptr;
+  release_base(_base, counters.live_files);
+  release_tier(_tier, _size);
+  std::uint64_t removed = 0;
+  auto const removed_file = _good && live && discard_registered(_path, _fd, _registration, &removed, _options.strategy, disposal_of(_owner_pid, _deferred));
+  release_label(_label, _size, removed);
+  return removed_file;
+}
+
+tempfile::scoped_file::scoped_file(std::string prefix, options opts)
+  : file(std::move(prefix), std::move(opts))
+{
+  create();
+}
+
+tempfile::scoped_file::~scoped_file() noexcept
+{
+  // ~file() removes it
+}
+
+
+
+
+tempfile::session::session(std::string prefix, options opts, bool keep_until_exit)
+  : _root(std::move(prefix), [&opts]
+  {
+    // the root itself goes to a base directory, and is swept if the process dies
+    opts.session = nullptr;
+    opts.bypass_default_session = true;
+    opts.mark_owner = true;
+    opts.strategy = strategy::exclusive;
+    return std::move(opts);
+  }())
+  , _keep_until_exit(keep_until_exit)
+{
+  if (!_root.create())
+  {
+    return;
+  }
+#ifdef __linux__
+  _fd = ::open(_root.path().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#elif !defined(_WIN32)
+  _fd = ::open(_root.path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+}
+
+tempfile::session::~session()
+{
+  auto * self = this;
+  default_session.compare_exchange_strong(self, nullptr);
+  close_file(_fd);
+  // ~directory() removes the whole tree
+}
+
+std::string tempfile::session::next_name(std::string const & prefix, naming how)
+{
+  name_buffer name;
+  append_session_name(name, *this, how);
+  return prefix + name.c_str();
+}
+
+
+static_assert(sizeof(tempfile::handle) <= 64, "handles are meant to stay compact");
+
+tempfile::handle::handle(std::string const & prefix, options const & opts)
+{
+  latency_timer timer(operation::file_create);
+  if (opts.strategy == strategy::mkstemp)
+  {
+    // the name mkstemp picks may not fit
+    count_failure(EOPNOTSUPP);
+    return;
+  }
+
+  // tiers do not apply to handles
+  auto const to = destination_of(opts, false, 0);
+  if (!anonymous(opts.strategy) && prefix.size() + longest_name(opts.naming, to.at_root) >= sizeof(_name))
+  {
+    // some name made with this prefix would not fit; refuse before creating any
+    count_failure(ENAMETOOLONG);
+    return;
+  }
+  path_t created;
+  detail::base * base = nullptr;
+  int fd = -1;
+  auto & live = counters.live_files;
+  auto good = false;
+#ifndef _WIN32
+  if (to.at_root)
+  {
+    good = create_in_session(*to.session, prefix, created, base, live, opts.naming, fan_out::none, [&fd](int root, char const * name)
+    {
+      fd = ::openat(root, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      return fd >= 0 ? 0 : errno;
+    });
+  }
+  else
+#endif
+  {
+    good = create_file(opts.strategy, opts.naming, fan_out::none, prefix, to.bases, created, base, fd);
+  }
+  if (!good)
+  {
+    return;
+  }
+
+  // keep only what puts the path back together: the base directory and the name in it
+  auto const name = anonymous(opts.strategy) ? std::string() : created.filename().string();
+  if (base->index == no_base_index)
+  {
+    // more base directories than handles can index
+    release_base(base, live);
+    discard_file(created, fd, nullptr, opts.strategy);
+    count_failure(EOVERFLOW);
+    return;
+  }
+  std::memcpy(_name, name.c_str(), name.size() + 1);
+  _base = base->index;
+  _fd = fd;
+  _owner_pid = process_id();
+  _deferred = to.session != nullptr && to.session->keeps_until_exit() && !anonymous(opts.strategy);
+  if (opts.inheritable)
+  {
+#ifndef _WIN32
+    ::fcntl(_fd, F_SETFD, ::fcntl(_fd, F_GETFD) & ~FD_CLOEXEC);
+#endif
+  }
+}
+
+tempfile::handle::handle(handle && other) noexcept
+  : _base(std::exchange(other._base, 0)), _fd(std::exchange(other._fd, -1)),
+    _owner_pid(std::exchange(other._owner_pid, 0)), _deferred(std::exchange(other._deferred, false))
 {
+  std::memcpy(_name, other._name, sizeof(_name));
+  other._name[0] = '\0';
+}
+
+tempfile::handle & tempfile::handle::operator=(handle && other) noexcept
+{
+  if (this != &other)
+  {
+    remove();
+    _base = std::exchange(other._base, 0);
+    _fd = std::exchange(other._fd, -1);
+    _owner_pid = std::exchange(other._owner_pid, 0);
+    _deferred = std::exchange(other._deferred, false);
+    std::memcpy(_name, other._name, sizeof(_name));
+    other._name[0] = '\0';
+  }
+  return *this;
 }
 
-tempfile::scoped_file::~scoped_file()
+tempfile::handle::~handle() noexcept
 {
+  latency_timer timer(operation::cleanup, _fd >= 0);
   remove();
 }
 
+tempfile::path_t tempfile::handle::path() const
+{
+  if (_fd < 0)
+  {
+    return {};
+  }
+  if (_name[0] == '\0')
+  {
+    return descriptor_path(_fd);
+  }
+  return base_at(_base)->path / _name;
+}
+
+bool tempfile::handle::remove() noexcept
+{
+  if (_fd < 0)
+  {
+    return false;
+  }
+  auto * base = base_at(_base);
+  path_t const & directory = base->path;
+  release_base(base, counters.live_files);
+  auto const owned = _owner_pid == process_id();
+  if (_name[0] == '\0' || !owned)
+  {
+    // unnamed files go with their descriptor; inherited ones are the parent's to remove
+    std::uint64_t bytes = 0;
+    struct stat st{};
+    if (owned && ::fstat(_fd, &st) == 0)
+    {
+      bytes = static_cast<std::uint64_t>(st.st_size);
+    }
+    close_file(_fd);
+    if (owned)
+    {
+      count(counters.removes);
+      count(counters.bytes_removed, bytes);
+    }
+    return owned;
+  }
 
+  // put the path together on the stack, as creating did
+  path_buffer path;
+  if (!append_directory(path, directory) || !path.append(_name, std::strlen(_name)))
+  {
+    close_file(_fd);
+    return false;
+  }
+  if (std::exchange(_deferred, false))
+  {
+    // left for the session to remove along with its root
+    close_file(_fd);
+    TEMPFILE_TRACE1(remove_deferred, path.c_str());
+    return true;
+  }
+  std::uint64_t bytes = 0;
+  struct stat st{};
+  if (::fstat(_fd, &st) == 0)
+  {
+    bytes = static_cast<std::uint64_t>(st.st_size);
+  }
+  close_file(_fd);
+  TEMPFILE_TRACE1(remove_start, path.c_str());
+  auto const error = remove_file(path.c_str());
+  TEMPFILE_TRACE3(remove_end, path.c_str(), bytes, error);
+  if (error != 0)
+  {
+    if (error != ENOENT)
+    {
+      count_failure(error);
+    }
+    return false;
+  }
+  count(counters.removes);
+  count(counters.bytes_removed, bytes);
+  return true;
+}
@@ -0,0 +1,49 @@
+/// Copyright (c) 2024 David Parrini
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+
+#ifndef TEMPFILE_TRACE_HPP
+#define TEMPFILE_TRACE_HPP
+
+// Static tracepoints (USDT) in the creation and cleanup paths, for bpftrace/perf/systemtap, e.g.
+//   bpftrace -e 'usdt:./libtempfile.so:tempfile:collision { @[str(arg0)] = count(); }'
+// They are compiled in only with the TEMPFILE_USDT CMake option; otherwise the macros expand to
+// nothing and their arguments are not evaluated.
+//
+// Probes (all in the "tempfile" provider):
+//   name_generated(name)            a candidate name was generated
+//   create_attempt(path)            creating `path` is attempted
+//   collision(path)                 `path` already existed
+//   create_failed(path, errno)      creating in the base directory of `path` failed
+//   remove_start(path)              removing a file or directory tree starts
+//   remove_end(path, bytes, errno)  it finished, with the bytes removed and 0 or the error
+//   remove_deferred(path)           removing is left to the session root, see keep_until_exit
+
+#ifdef TEMPFILE_USDT
+#include <sys/sdt.h>
+#define TEMPFILE_TRACE1(name, a) DTRACE_PROBE1(tempfile, name, a)
+#define TEMPFILE_TRACE2(name, a, b) DTRACE_PROBE2(tempfile, name, a, b)
+#define TEMPFILE_TRACE3(name, a, b, c) DTRACE_PROBE3(tempfile, name, a, b, c)
+#else
+#define TEMPFILE_TRACE1(name, a) ((void) 0)
+#define TEMPFILE_TRACE2(name, a, b) ((void) 0)
+#define TEMPFILE_TRACE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif //TEMPFILE_TRACE_HPP